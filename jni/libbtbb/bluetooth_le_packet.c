@@ -27,6 +27,7 @@
 
 #include "btbb.h"
 #include "bluetooth_le_packet.h"
+#include "packet_pool.h"
 #include <ctype.h>
 #include <string.h>
 
@@ -48,10 +49,14 @@ static const char *CONNECT_SCA[] = {
 
 static uint8_t count_bits(uint32_t n)
 {
+#ifdef __GNUC__
+	return __builtin_popcount(n);
+#else
 	uint8_t i = 0;
 	for (i = 0; n != 0; i++)
 		n &= n - 1;
 	return i;
+#endif
 }
 
 static int aa_access_channel_off_by_one(const uint32_t aa) {
@@ -62,6 +67,30 @@ static int aa_access_channel_off_by_one(const uint32_t aa) {
 	return retval;
 }
 
+/* 12 bit windows of an access address holding too long a run of equal
+ * bits, one bit per window value */
+static const uint64_t AA_RUN_VIOLATIONS[64] = {
+	0x00000000ffffffffULL, 0x8000000000000000ULL, 0x0000000000000001ULL, 0xc000000000000000ULL,
+	0x0000000000000003ULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xf000000000000000ULL,
+	0x000000000000000eULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xc000000000000000ULL,
+	0x0000000000000003ULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xff00000000000000ULL,
+	0x00000000000000fdULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xc000000000000000ULL,
+	0x0000000000000003ULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xf000000000000000ULL,
+	0x000000000000000eULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xc000000000000000ULL,
+	0x0000000000000003ULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xfff0000000000000ULL,
+	0x000000000000ffffULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xc000000000000000ULL,
+	0x0000000000000003ULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xf000000000000000ULL,
+	0x000000000000000eULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xc000000000000000ULL,
+	0x0000000000000003ULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xff00000000000000ULL,
+	0x00000000000000ffULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xc000000000000000ULL,
+	0x0000000000000003ULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xf000000000000000ULL,
+	0x000000000000000fULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xc000000000000000ULL,
+	0x0000000000000003ULL, 0x0000000000000000ULL, 0x0000000000000001ULL, 0xffff000100000000ULL
+};
+
+/* 6 MSB values of an access address with at least two transitions */
+#define AA_MSB6_ALLOWED 0x2efefffe7fff7f74ULL
+
 /*
  * A helper function for filtering bogus packets on data channels.
  *
@@ -86,153 +115,52 @@ static int aa_access_channel_off_by_one(const uint32_t aa) {
  *  - It shall have a minimum of two transitions in the most significant six bits.
  */
 static int aa_data_channel_offenses(const uint32_t aa) {
-	int retval = 0, transitions = 0;
-	unsigned shift, odd = (unsigned) (aa & 1);
-	uint8_t aab3, aab2, aab1, aab0 = (uint8_t) (aa & 0xff);
-
-	const uint8_t EIGHT_BIT_TRANSITIONS_EVEN[256] = {
-		0, 2, 2, 2, 2, 4, 2, 2, 2, 4, 4, 4, 2, 4, 2, 2,
-		2, 4, 4, 4, 4, 6, 4, 4, 2, 4, 4, 4, 2, 4, 2, 2,
-		2, 4, 4, 4, 4, 6, 4, 4, 4, 6, 6, 6, 4, 6, 4, 4,
-		2, 4, 4, 4, 4, 6, 4, 4, 2, 4, 4, 4, 2, 4, 2, 2,
-		2, 4, 4, 4, 4, 6, 4, 4, 4, 6, 6, 6, 4, 6, 4, 4,
-		4, 6, 6, 6, 6, 8, 6, 6, 4, 6, 6, 6, 4, 6, 4, 4,
-		2, 4, 4, 4, 4, 6, 4, 4, 4, 6, 6, 6, 4, 6, 4, 4,
-		2, 4, 4, 4, 4, 6, 4, 4, 2, 4, 4, 4, 2, 4, 2, 2,
-		1, 3, 3, 3, 3, 5, 3, 3, 3, 5, 5, 5, 3, 5, 3, 3,
-		3, 5, 5, 5, 5, 7, 5, 5, 3, 5, 5, 5, 3, 5, 3, 3,
-		3, 5, 5, 5, 5, 7, 5, 5, 5, 7, 7, 7, 5, 7, 5, 5,
-		3, 5, 5, 5, 5, 7, 5, 5, 3, 5, 5, 5, 3, 5, 3, 3,
-		1, 3, 3, 3, 3, 5, 3, 3, 3, 5, 5, 5, 3, 5, 3, 3,
-		3, 5, 5, 5, 5, 7, 5, 5, 3, 5, 5, 5, 3, 5, 3, 3,
-		1, 3, 3, 3, 3, 5, 3, 3, 3, 5, 5, 5, 3, 5, 3, 3,
-		1, 3, 3, 3, 3, 5, 3, 3, 1, 3, 3, 3, 1, 3, 1, 1
-	};
-
-	const uint8_t EIGHT_BIT_TRANSITIONS_ODD[256] = {
-		1, 1, 3, 1, 3, 3, 3, 1, 3, 3, 5, 3, 3, 3, 3, 1,
-		3, 3, 5, 3, 5, 5, 5, 3, 3, 3, 5, 3, 3, 3, 3, 1,
-		3, 3, 5, 3, 5, 5, 5, 3, 5, 5, 7, 5, 5, 5, 5, 3,
-		3, 3, 5, 3, 5, 5, 5, 3, 3, 3, 5, 3, 3, 3, 3, 1,
-		3, 3, 5, 3, 5, 5, 5, 3, 5, 5, 7, 5, 5, 5, 5, 3,
-		5, 5, 7, 5, 7, 7, 7, 5, 5, 5, 7, 5, 5, 5, 5, 3,
-		3, 3, 5, 3, 5, 5, 5, 3, 5, 5, 7, 5, 5, 5, 5, 3,
-		3, 3, 5, 3, 5, 5, 5, 3, 3, 3, 5, 3, 3, 3, 3, 1,
-		2, 2, 4, 2, 4, 4, 4, 2, 4, 4, 6, 4, 4, 4, 4, 2,
-		4, 4, 6, 4, 6, 6, 6, 4, 4, 4, 6, 4, 4, 4, 4, 2,
-		4, 4, 6, 4, 6, 6, 6, 4, 6, 6, 8, 6, 6, 6, 6, 4,
-		4, 4, 6, 4, 6, 6, 6, 4, 4, 4, 6, 4, 4, 4, 4, 2,
-		2, 2, 4, 2, 4, 4, 4, 2, 4, 4, 6, 4, 4, 4, 4, 2,
-		4, 4, 6, 4, 6, 6, 6, 4, 4, 4, 6, 4, 4, 4, 4, 2,
-		2, 2, 4, 2, 4, 4, 4, 2, 4, 4, 6, 4, 4, 4, 4, 2,
-		2, 2, 4, 2, 4, 4, 4, 2, 2, 2, 4, 2, 2, 2, 2, 0
-	};
-
-	transitions += (odd ? EIGHT_BIT_TRANSITIONS_ODD[aab0] : EIGHT_BIT_TRANSITIONS_EVEN[aab0] );
-	odd = (unsigned) (aab0 & 0x80);
-	aab1 = (uint8_t) (aa >> 8);
-	transitions += (odd ? EIGHT_BIT_TRANSITIONS_ODD[aab1] : EIGHT_BIT_TRANSITIONS_EVEN[aab1] );
-	odd = (unsigned) (aab1 & 0x80);
-	aab2 = (uint8_t) (aa >> 16);
-	transitions += (odd ? EIGHT_BIT_TRANSITIONS_ODD[aab2] : EIGHT_BIT_TRANSITIONS_EVEN[aab2] );
-	odd = (unsigned) (aab2 & 0x80);
-	aab3 = (uint8_t) (aa >> 24);
-	transitions += (odd ? EIGHT_BIT_TRANSITIONS_ODD[aab3] : EIGHT_BIT_TRANSITIONS_EVEN[aab3] );
+	int retval = 0, transitions, excess;
+	unsigned shift, twelvebits;
 
-	/* consider excessive transitions as offenses */
-	if (transitions > 24) {
-		retval += (transitions - 24);
-	}
+	/* every bit compared to the one before it */
+	transitions = count_bits((aa ^ (aa << 1)) & 0xfffffffe);
 
-	const uint8_t AA_MSB6_ALLOWED[64] = {
-		0, 0, 1, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 0,
-		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
-		0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-		0, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 0, 1, 0, 0
-	};
+	/* consider excessive transitions as offenses */
+	excess = transitions - 24;
+	retval += excess & -(excess > 0);
 
 	/* consider excessive transitions in the 6 MSBs as an offense */
-	retval += (1 - AA_MSB6_ALLOWED[aab3>>2]);
+	retval += 1 - (int) ((AA_MSB6_ALLOWED >> (aa >> 26)) & 1);
 
 	/* consider all bytes as being equal an offense */
-	retval += (((aab0 == aab1) && (aab0 == aab2) && (aab0 == aab3)) ? 1 : 0);
+	retval += (aa == (aa & 0xff) * 0x01010101U);
 
 	/* access-channel address and off-by-ones are illegal */
-	retval += ((aa == LE_ADV_AA) ? 1 : 0);
-	retval += aa_access_channel_off_by_one(aa);
+	retval += (aa == LE_ADV_AA);
+	retval += (count_bits(aa ^ LE_ADV_AA) == 1);
 
 	/* inspect nibble triples for insufficient bit transitions */
 	for(shift=0; shift<=20; shift+=4) {
-		uint16_t twelvebits = (uint16_t) ((aa >> shift) & 0xfff);
-		switch( twelvebits ) {
-			/* seven consecutive zeroes */
-		case 0x080: case 0x180: case 0x280: case 0x380: case 0x480:
-		case 0x580: case 0x680: case 0x780: case 0x880: case 0x980:
-		case 0xa80: case 0xb80: case 0xc80: case 0xd80: case 0xe80:
-		case 0xf80: case 0x101: case 0x301: case 0x501: case 0x701:
-		case 0x901: case 0xb01: case 0xd01: case 0xf01: case 0x202:
-		case 0x602: case 0xa02: case 0xe02: case 0x203: case 0x603:
-		case 0xa03: case 0xe03: case 0x404: case 0xc04: case 0x405:
-		case 0xc05: case 0x406: case 0xc06: case 0x407: case 0xc07:
-		case 0x808: case 0x809: case 0x80a: case 0x80b: case 0x80c:
-		case 0x80d: case 0x80e: case 0x80f: case 0x010: case 0x011:
-		case 0x012: case 0x013: case 0x014: case 0x015: case 0x016:
-		case 0x017: case 0x018: case 0x019: case 0x01a: case 0x01b:
-		case 0x01c: case 0x01d: case 0x01e: case 0x01f:
-			/* eight consecutive zeroes */
-		case 0x100: case 0x300: case 0x500: case 0x700: case 0x900:
-		case 0xb00: case 0xd00: case 0xf00: case 0x201: case 0x601:
-		case 0xa01: case 0xe01: case 0x402: case 0xc02: case 0x403:
-		case 0xc03: case 0x804: case 0x805: case 0x806: case 0x807:
-		case 0x008: case 0x009: case 0x00a: case 0x00b: case 0x00c:
-		case 0x00d: case 0x00e: case 0x00f:
-			/* nine consecutive zeroes */
-		case 0xe00: case 0xc01: case 0x802: case 0x803: case 0x004:
-		case 0x005: case 0x006: case 0x007:
-			/* ten consecutive zeroes */
-		case 0x400: case 0xc00: case 0x801: case 0x002: case 0x003:
-			/* eleven consecutive zeroes */
-		case 0x800: case 0x001:
-			/* twelve consecutive zeroes */
-		case 0x000:
-			/* seven consecutive ones */
-		case 0x07f: case 0x0fe: case 0x2fe: case 0x4fe: case 0x6fe:
-		case 0x8fe: case 0xafe: case 0xcfe: case 0xefe: case 0x1fc:
-		case 0x5fc: case 0x9fc: case 0xdfc: case 0x1fd: case 0x5fd:
-		case 0x9fd: case 0xdfd: case 0x3f8: case 0xbf8: case 0x3f9:
-		case 0xbf9: case 0x3fa: case 0xbfa: case 0x3fb: case 0xbfb:
-		case 0x7f4: case 0x7f5: case 0x7f6: case 0x7f7: case 0xfe0:
-			/* eight consecutive ones */
-		case 0x0ff: case 0x2ff: case 0x4ff: case 0x6ff: case 0x8ff:
-		case 0xaff: case 0xcff: case 0xeff: case 0x1fe: case 0x5fe:
-		case 0x9fe: case 0xdfe: case 0x3fc: case 0xbfc: case 0x3fd:
-		case 0xbfd: case 0x7f8: case 0x7f9: case 0x7fa: case 0x7fb:
-		case 0xff0: case 0xff1: case 0xff2: case 0xff3: case 0xff4:
-		case 0xff5: case 0xff6: case 0xff7:
-			/* nine consecutive ones */
-		case 0x1ff: case 0x5ff: case 0x9ff: case 0xdff: case 0x3fe:
-		case 0xbfe: case 0x7fc: case 0x7fd: case 0xff8: case 0xff9:
-		case 0xffa: case 0xffb:
-			/* ten consecutive ones */
-		case 0x3ff: case 0xbff: case 0x7fe: case 0xffc: case 0xffd:
-			/* eleven consecutive ones */
-		case 0x7ff: case 0xffe:
-			/* all ones */
-		case 0xfff:
-			retval++;
-			break;
-		default:
-			break;
-		}
+		twelvebits = (aa >> shift) & 0xfff;
+		retval += (AA_RUN_VIOLATIONS[twelvebits >> 6] >> (twelvebits & 63)) & 1;
 	}
 
 	return retval;
 }
 
+void lell_aa_offenses(const uint32_t *aa, unsigned *offenses, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		offenses[i] = aa_data_channel_offenses(aa[i]);
+}
+
 lell_packet *
 lell_packet_new(void)
 {
-	lell_packet *pkt = (lell_packet *)calloc(1, sizeof(lell_packet));
+	lell_packet *pkt = (lell_packet *)packet_pool_get(PACKET_POOL_LELL);
+
+	if (pkt)
+		memset(pkt, 0, sizeof(lell_packet));
+	else
+		pkt = (lell_packet *)calloc(1, sizeof(lell_packet));
 	pkt->refcount = 1;
 	return pkt;
 }
@@ -247,7 +175,7 @@ void
 lell_packet_unref(lell_packet *pkt)
 {
 	pkt->refcount--;
-	if (pkt->refcount == 0)
+	if (pkt->refcount == 0 && !packet_pool_put(PACKET_POOL_LELL, pkt))
 		free(pkt);
 }
 
@@ -267,38 +195,62 @@ static uint8_t le_channel_index(uint16_t phys_channel) {
 	return ret;
 }
 
-void lell_allocate_and_decode(const uint8_t *stream, uint16_t phys_channel, uint32_t clk100ns, lell_packet **pkt)
+/* access address offenses for a packet on a data or advertising channel */
+static unsigned aa_offenses(const uint32_t aa, int is_data)
 {
-	*pkt = lell_packet_new( );
-	memcpy((*pkt)->symbols, stream, MAX_LE_SYMBOLS);
+	if (is_data)
+		return aa_data_channel_offenses(aa);
+	if (aa == LE_ADV_AA)
+		return 0;
+	return aa_access_channel_off_by_one(aa) ? 1 : 32;
+}
+
+static uint32_t stream_access_address(const uint8_t *stream)
+{
+	return stream[0] | (stream[1] << 8) | (stream[2] << 16) | ((uint32_t) stream[3] << 24);
+}
 
-	(*pkt)->channel_idx = le_channel_index(phys_channel);
-	(*pkt)->channel_k = (phys_channel-2402)/2;
-	(*pkt)->clk100ns = clk100ns;
+unsigned lell_stream_aa_offenses(const uint8_t *stream, uint16_t phys_channel)
+{
+	return aa_offenses(stream_access_address(stream),
+			   le_channel_index(phys_channel) < 37);
+}
+
+void lell_decode_into(const uint8_t *stream, uint16_t phys_channel, uint32_t clk100ns, lell_packet *pkt)
+{
+	uint32_t refcount = pkt->refcount;
 
-	(*pkt)->access_address = 0;
-	(*pkt)->access_address |= (*pkt)->symbols[0];
-	(*pkt)->access_address |= (*pkt)->symbols[1] << 8;
-	(*pkt)->access_address |= (*pkt)->symbols[2] << 16;
-	(*pkt)->access_address |= (*pkt)->symbols[3] << 24;
+	memset(pkt, 0, sizeof(lell_packet));
+	pkt->refcount = refcount;
+	memcpy(pkt->symbols, stream, MAX_LE_SYMBOLS);
 
-	if (lell_packet_is_data(*pkt)) {
+	pkt->channel_idx = le_channel_index(phys_channel);
+	pkt->channel_k = (phys_channel-2402)/2;
+	pkt->clk100ns = clk100ns;
+
+	pkt->access_address = stream_access_address(pkt->symbols);
+	pkt->access_address_offenses = aa_offenses(pkt->access_address,
+						   lell_packet_is_data(pkt));
+	pkt->flags.as_bits.access_address_ok = pkt->access_address_offenses ? 0 : 1;
+
+	if (lell_packet_is_data(pkt)) {
 		// data PDU
-		(*pkt)->length = (*pkt)->symbols[5] & 0x1f;
-		(*pkt)->access_address_offenses = aa_data_channel_offenses((*pkt)->access_address);
-		(*pkt)->flags.as_bits.access_address_ok = (*pkt)->access_address_offenses ? 0 : 1;
+		pkt->length = pkt->symbols[5] & 0x1f;
 	} else {
 		// advertising PDU
-		(*pkt)->length = (*pkt)->symbols[5] & 0x3f;
-		(*pkt)->adv_type = (*pkt)->symbols[4] & 0xf;
-		(*pkt)->adv_tx_add = (*pkt)->symbols[4] & 0x40 ? 1 : 0;
-		(*pkt)->adv_rx_add = (*pkt)->symbols[4] & 0x80 ? 1 : 0;
-		(*pkt)->flags.as_bits.access_address_ok = ((*pkt)->access_address == 0x8e89bed6);
-		(*pkt)->access_address_offenses = (*pkt)->flags.as_bits.access_address_ok ? 0 :
-			(aa_access_channel_off_by_one((*pkt)->access_address) ? 1 : 32);
+		pkt->length = pkt->symbols[5] & 0x3f;
+		pkt->adv_type = pkt->symbols[4] & 0xf;
+		pkt->adv_tx_add = pkt->symbols[4] & 0x40 ? 1 : 0;
+		pkt->adv_rx_add = pkt->symbols[4] & 0x80 ? 1 : 0;
 	}
 }
 
+void lell_allocate_and_decode(const uint8_t *stream, uint16_t phys_channel, uint32_t clk100ns, lell_packet **pkt)
+{
+	*pkt = lell_packet_new( );
+	lell_decode_into(stream, phys_channel, clk100ns, *pkt);
+}
+
 unsigned lell_packet_is_data(const lell_packet *pkt)
 {
 	return (unsigned) (pkt->channel_idx < 37);
@@ -0,0 +1,239 @@
+/* -*- c -*- */
+/*
+ * This file is part of libbtbb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libbtbb; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "btbb.h"
+#include "bluetooth_le_packet.h"
+
+/* LL control PDU opcodes the tracker follows */
+#define LL_CONNECTION_UPDATE_REQ 0x00
+#define LL_CHANNEL_MAP_REQ 0x01
+#define LL_TERMINATE_IND 0x02
+
+typedef struct {
+	lell_connection conn;
+	uint32_t used; /* tracker tick of the last packet, 0 for a free slot */
+} tracker_slot;
+
+struct lell_tracker {
+	pthread_mutex_t lock;
+	uint32_t mask;      /* slots - 1 */
+	uint32_t count;     /* connections held */
+	uint32_t max_count; /* evict beyond this, keeps probes short */
+	uint32_t tick;
+	uint32_t now;       /* clk100ns of the latest packet */
+	tracker_slot *slots;
+};
+
+static uint32_t tracker_home(const lell_tracker *t, uint32_t aa)
+{
+	return (aa * 0x9e3779b1U) >> 16 & t->mask;
+}
+
+/* slot holding 'aa', or the free slot where it would go */
+static uint32_t tracker_probe(const lell_tracker *t, uint32_t aa)
+{
+	uint32_t i = tracker_home(t, aa);
+
+	while (t->slots[i].used && t->slots[i].conn.access_address != aa)
+		i = (i + 1) & t->mask;
+	return i;
+}
+
+/* empty slot i, moving later entries of its probe run back into it */
+static void tracker_remove(lell_tracker *t, uint32_t i)
+{
+	uint32_t j = i, home;
+
+	t->slots[i].used = 0;
+	t->count--;
+	for (;;) {
+		j = (j + 1) & t->mask;
+		if (!t->slots[j].used)
+			return;
+		home = tracker_home(t, t->slots[j].conn.access_address);
+		/* leave it if its home lies cyclically in (i, j] */
+		if (((j - home) & t->mask) < ((j - i) & t->mask))
+			continue;
+		t->slots[i] = t->slots[j];
+		t->slots[j].used = 0;
+		i = j;
+	}
+}
+
+static void tracker_evict_oldest(lell_tracker *t)
+{
+	uint32_t i, oldest = 0, age, max_age = 0;
+
+	for (i = 0; i <= t->mask; i++) {
+		if (!t->slots[i].used)
+			continue;
+		age = t->tick - t->slots[i].used;
+		if (age >= max_age) {
+			max_age = age;
+			oldest = i;
+		}
+	}
+	tracker_remove(t, oldest);
+}
+
+/* slot for 'aa', taking a new one (and evicting if full) when unknown */
+static tracker_slot *tracker_slot_for(lell_tracker *t, uint32_t aa, uint32_t clk100ns)
+{
+	uint32_t i = tracker_probe(t, aa);
+	tracker_slot *s = &t->slots[i];
+
+	if (!s->used) {
+		if (t->count >= t->max_count) {
+			tracker_evict_oldest(t);
+			s = &t->slots[tracker_probe(t, aa)];
+		}
+		memset(s, 0, sizeof(tracker_slot));
+		s->conn.access_address = aa;
+		s->conn.first_seen = clk100ns;
+		t->count++;
+	}
+	/* tick 0 marks a free slot */
+	if (++t->tick == 0)
+		t->tick = 1;
+	s->used = t->tick;
+	s->conn.last_seen = clk100ns;
+	return s;
+}
+
+lell_tracker *lell_tracker_new(unsigned capacity)
+{
+	lell_tracker *t;
+	uint32_t slots = 16;
+
+	/* keep the table at most 3/4 full */
+	while (slots * 3 / 4 < capacity)
+		slots <<= 1;
+
+	t = (lell_tracker *) calloc(1, sizeof(lell_tracker));
+	if (!t)
+		return NULL;
+	t->slots = (tracker_slot *) calloc(slots, sizeof(tracker_slot));
+	if (!t->slots) {
+		free(t);
+		return NULL;
+	}
+	pthread_mutex_init(&t->lock, NULL);
+	t->mask = slots - 1;
+	t->max_count = capacity ? capacity : slots * 3 / 4;
+	return t;
+}
+
+void lell_tracker_free(lell_tracker *t)
+{
+	if (!t)
+		return;
+	pthread_mutex_destroy(&t->lock);
+	free(t->slots);
+	free(t);
+}
+
+static uint16_t le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+void lell_tracker_update(lell_tracker *t, const lell_packet *pkt)
+{
+	const uint8_t *sym = pkt->symbols;
+	tracker_slot *s;
+	uint32_t aa;
+
+	/* noise would fill the table with bogus connections */
+	if (!pkt->flags.as_bits.access_address_ok)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+	t->now = pkt->clk100ns;
+
+	if (!lell_packet_is_data(pkt)) {
+		/* a CONNECT_REQ announces a connection and its parameters */
+		if (pkt->adv_type == CONNECT_REQ && pkt->length >= 34) {
+			aa = sym[18] | (sym[19] << 8) | (sym[20] << 16) | ((uint32_t) sym[21] << 24);
+			s = tracker_slot_for(t, aa, pkt->clk100ns);
+			s->conn.crc_init = sym[22] | (sym[23] << 8) | (sym[24] << 16);
+			s->conn.interval = le16(&sym[28]);
+			memcpy(s->conn.channel_map, &sym[34], 5);
+			s->conn.hop_increment = sym[39] & 0x1f;
+			s->conn.params_known = 1;
+		}
+		pthread_mutex_unlock(&t->lock);
+		return;
+	}
+
+	s = tracker_slot_for(t, pkt->access_address, pkt->clk100ns);
+	s->conn.packets++;
+
+	/* LL control PDUs change the connection; they take effect at their
+	 * instant, which is not tracked, so they apply as soon as seen */
+	if ((sym[4] & 0x3) == 3 && pkt->length >= 1) {
+		switch (sym[6]) {
+		case LL_CONNECTION_UPDATE_REQ:
+			if (pkt->length >= 12)
+				s->conn.interval = le16(&sym[10]);
+			break;
+		case LL_CHANNEL_MAP_REQ:
+			if (pkt->length >= 8)
+				memcpy(s->conn.channel_map, &sym[7], 5);
+			break;
+		case LL_TERMINATE_IND:
+			tracker_remove(t, s - t->slots);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+int lell_tracker_find(lell_tracker *t, uint32_t access_address, lell_connection *conn)
+{
+	uint32_t i;
+	int found;
+
+	pthread_mutex_lock(&t->lock);
+	i = tracker_probe(t, access_address);
+	found = t->slots[i].used != 0;
+	if (found && conn)
+		*conn = t->slots[i].conn;
+	pthread_mutex_unlock(&t->lock);
+	return found;
+}
+
+int lell_tracker_live(lell_tracker *t, uint32_t max_age, lell_connection *conns, int max)
+{
+	uint32_t i;
+	int n = 0;
+
+	pthread_mutex_lock(&t->lock);
+	for (i = 0; i <= t->mask && n < max; i++) {
+		if (t->slots[i].used &&
+		    (uint32_t) (t->now - t->slots[i].conn.last_seen) <= max_age)
+			conns[n++] = t->slots[i].conn;
+	}
+	pthread_mutex_unlock(&t->lock);
+	return n;
+}
@@ -22,18 +22,36 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "bluetooth_packet.h"
-#include "uthash.h"
+#include "packet_pool.h"
 #include "sw_check_tables.h"
 #include "version.h"
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 
 /* Maximum number of AC errors supported by library. Caller may
  * specify any value <= AC_ERROR_LIMIT in btbb_init(). */
 #define AC_ERROR_LIMIT 5
 
+/* Upper bound on threads used to build the syndrome table */
+#define MAX_SYNDROME_THREADS 16
+
+/* Largest payload unfec23() decodes, rounded up to whole blocks */
+#define FEC23_MAX_BITS (MAX_PAYLOAD_LENGTH + 10)
+
+/* symbols unfec23() reads to decode 'bits' bits */
+#define FEC23_SYMBOLS(bits) (((bits) + 9) / 10 * 15)
+
 /* maximum number of bit errors for known syncwords */
 #define MAX_SYNCWORD_ERRS 5
 
@@ -46,11 +64,235 @@
 /* Default access code, used for calculating syndromes */
 #define DEFAULT_AC 0xcc7b7268ff614e1bULL
 
-/* index into whitening data array */
-static const uint8_t INDICES[] = {99, 85, 17, 50, 102, 58, 108, 45, 92, 62, 32, 118, 88, 11, 80, 2, 37, 69, 55, 8, 20, 40, 74, 114, 15, 106, 30, 78, 53, 72, 28, 26, 68, 7, 39, 113, 105, 77, 71, 25, 84, 49, 57, 44, 61, 117, 10, 1, 123, 124, 22, 125, 111, 23, 42, 126, 6, 112, 76, 24, 48, 43, 116, 0};
+/* Whitening keystream for each CLK1-6 value, packed LSB first: the
+ * output of the x^7 + x^4 + 1 whitening LFSR initialised from the clock,
+ * extended to 192 bits so that 64 bits can be read from any position in
+ * the 127 bit cycle */
+static const uint64_t WHITENING_KEYSTREAM[64][3] = {
+	{0x157d28dc7f0ef2c9ULL, 0x8113175b066a73daULL, 0x0abe946e3f877964ULL},
+	{0x4a371fc3bcb24089ULL, 0xc5d6c19a9cf6855fULL, 0xa51b8fe1de592044ULL},
+	{0xbad833539ed0abe9ULL, 0xa371fc3bcb240898ULL, 0x5d6c19a9cf6855f4ULL},
+	{0xe592044c5d6c19a9ULL, 0xe7b42afa51b8fe1dULL, 0xf2c902262eb60cd4ULL},
+	{0x42afa51b8fe1de59ULL, 0x902262eb60cd4e7bULL, 0xa157d28dc7f0ef2cULL},
+	{0x1de592044c5d6c19ULL, 0xd4e7b42afa51b8feULL, 0x0ef2c902262eb60cULL},
+	{0xed0abe946e3f8779ULL, 0xb240898bad833539ULL, 0xf6855f4a371fc3bcULL},
+	{0xb240898bad833539ULL, 0xf6855f4a371fc3bcULL, 0x592044c5d6c19a9cULL},
+	{0xbe946e3f87796481ULL, 0x898bad833539ed0aULL, 0x5f4a371fc3bcb240ULL},
+	{0xe1de592044c5d6c1ULL, 0xcd4e7b42afa51b8fULL, 0xf0ef2c902262eb60ULL},
+	{0x113175b066a73da1ULL, 0xabe946e3f8779648ULL, 0x0898bad833539ed0ULL},
+	{0x4e7b42afa51b8fe1ULL, 0xef2c902262eb60cdULL, 0xa73da157d28dc7f0ULL},
+	{0xe946e3f877964811ULL, 0x98bad833539ed0abULL, 0xf4a371fc3bcb2408ULL},
+	{0xb60cd4e7b42afa51ULL, 0xdc7f0ef2c902262eULL, 0x5b066a73da157d28ULL},
+	{0x46e3f87796481131ULL, 0xbad833539ed0abe9ULL, 0xa371fc3bcb240898ULL},
+	{0x19a9cf6855f4a371ULL, 0xfe1de592044c5d6cULL, 0x0cd4e7b42afa51b8ULL},
+	{0x40898bad833539edULL, 0x855f4a371fc3bcb2ULL, 0x2044c5d6c19a9cf6ULL},
+	{0x1fc3bcb240898badULL, 0xc19a9cf6855f4a37ULL, 0x8fe1de592044c5d6ULL},
+	{0xef2c902262eb60cdULL, 0xa73da157d28dc7f0ULL, 0x779648113175b066ULL},
+	{0xb066a73da157d28dULL, 0xe3f8779648113175ULL, 0xd833539ed0abe946ULL},
+	{0x175b066a73da157dULL, 0x946e3f8779648113ULL, 0x8bad833539ed0abeULL},
+	{0x48113175b066a73dULL, 0xd0abe946e3f87796ULL, 0x240898bad833539eULL},
+	{0xb8fe1de592044c5dULL, 0xb60cd4e7b42afa51ULL, 0xdc7f0ef2c902262eULL},
+	{0xe7b42afa51b8fe1dULL, 0xf2c902262eb60cd4ULL, 0x73da157d28dc7f0eULL},
+	{0xeb60cd4e7b42afa5ULL, 0x8dc7f0ef2c902262ULL, 0x75b066a73da157d2ULL},
+	{0xb42afa51b8fe1de5ULL, 0xc902262eb60cd4e7ULL, 0xda157d28dc7f0ef2ULL},
+	{0x44c5d6c19a9cf685ULL, 0xafa51b8fe1de5920ULL, 0x2262eb60cd4e7b42ULL},
+	{0x1b8fe1de592044c5ULL, 0xeb60cd4e7b42afa5ULL, 0x8dc7f0ef2c902262ULL},
+	{0xbcb240898bad8335ULL, 0x9cf6855f4a371fc3ULL, 0xde592044c5d6c19aULL},
+	{0xe3f8779648113175ULL, 0xd833539ed0abe946ULL, 0x71fc3bcb240898baULL},
+	{0x13175b066a73da15ULL, 0xbe946e3f87796481ULL, 0x898bad833539ed0aULL},
+	{0x4c5d6c19a9cf6855ULL, 0xfa51b8fe1de59204ULL, 0x262eb60cd4e7b42aULL},
+	{0x3f8779648113175bULL, 0x833539ed0abe946eULL, 0x1fc3bcb240898badULL},
+	{0x60cd4e7b42afa51bULL, 0xc7f0ef2c902262ebULL, 0xb066a73da157d28dULL},
+	{0x902262eb60cd4e7bULL, 0xa157d28dc7f0ef2cULL, 0x48113175b066a73dULL},
+	{0xcf6855f4a371fc3bULL, 0xe592044c5d6c19a9ULL, 0xe7b42afa51b8fe1dULL},
+	{0x6855f4a371fc3bcbULL, 0x92044c5d6c19a9cfULL, 0xb42afa51b8fe1de5ULL},
+	{0x371fc3bcb240898bULL, 0xd6c19a9cf6855f4aULL, 0x1b8fe1de592044c5ULL},
+	{0xc7f0ef2c902262ebULL, 0xb066a73da157d28dULL, 0xe3f8779648113175ULL},
+	{0x98bad833539ed0abULL, 0xf4a371fc3bcb2408ULL, 0x4c5d6c19a9cf6855ULL},
+	{0x946e3f8779648113ULL, 0x8bad833539ed0abeULL, 0x4a371fc3bcb24089ULL},
+	{0xcb240898bad83353ULL, 0xcf6855f4a371fc3bULL, 0xe592044c5d6c19a9ULL},
+	{0x3bcb240898bad833ULL, 0xa9cf6855f4a371fcULL, 0x1de592044c5d6c19ULL},
+	{0x648113175b066a73ULL, 0xed0abe946e3f8779ULL, 0xb240898bad833539ULL},
+	{0xc3bcb240898bad83ULL, 0x9a9cf6855f4a371fULL, 0xe1de592044c5d6c1ULL},
+	{0x9cf6855f4a371fc3ULL, 0xde592044c5d6c19aULL, 0x4e7b42afa51b8fe1ULL},
+	{0x6c19a9cf6855f4a3ULL, 0xb8fe1de592044c5dULL, 0xb60cd4e7b42afa51ULL},
+	{0x33539ed0abe946e3ULL, 0xfc3bcb240898bad8ULL, 0x19a9cf6855f4a371ULL},
+	{0x6a73da157d28dc7fULL, 0x8779648113175b06ULL, 0x3539ed0abe946e3fULL},
+	{0x3539ed0abe946e3fULL, 0xc3bcb240898bad83ULL, 0x9a9cf6855f4a371fULL},
+	{0xc5d6c19a9cf6855fULL, 0xa51b8fe1de592044ULL, 0x62eb60cd4e7b42afULL},
+	{0x9a9cf6855f4a371fULL, 0xe1de592044c5d6c1ULL, 0xcd4e7b42afa51b8fULL},
+	{0x3da157d28dc7f0efULL, 0x9648113175b066a7ULL, 0x9ed0abe946e3f877ULL},
+	{0x62eb60cd4e7b42afULL, 0xd28dc7f0ef2c9022ULL, 0x3175b066a73da157ULL},
+	{0x92044c5d6c19a9cfULL, 0xb42afa51b8fe1de5ULL, 0xc902262eb60cd4e7ULL},
+	{0xcd4e7b42afa51b8fULL, 0xf0ef2c902262eb60ULL, 0x66a73da157d28dc7ULL},
+	{0xc19a9cf6855f4a37ULL, 0x8fe1de592044c5d6ULL, 0x60cd4e7b42afa51bULL},
+	{0x9ed0abe946e3f877ULL, 0xcb240898bad83353ULL, 0xcf6855f4a371fc3bULL},
+	{0x6e3f877964811317ULL, 0xad833539ed0abe94ULL, 0x371fc3bcb240898bULL},
+	{0x3175b066a73da157ULL, 0xe946e3f877964811ULL, 0x98bad833539ed0abULL},
+	{0x9648113175b066a7ULL, 0x9ed0abe946e3f877ULL, 0xcb240898bad83353ULL},
+	{0xc902262eb60cd4e7ULL, 0xda157d28dc7f0ef2ULL, 0x648113175b066a73ULL},
+	{0x39ed0abe946e3f87ULL, 0xbcb240898bad8335ULL, 0x9cf6855f4a371fc3ULL},
+	{0x66a73da157d28dc7ULL, 0xf8779648113175b0ULL, 0x33539ed0abe946e3ULL}};
+
+/* CRC-16 (x^16 + x^12 + x^5 + 1) register update for one byte of
+ * payload, bits taken LSB first as in crcgen() */
+static const uint16_t CRC16_TABLE[256] = {
+	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+	0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+	0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+	0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+	0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+	0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+	0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+	0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+	0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+	0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+	0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+	0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+	0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+	0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+	0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+	0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+	0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+	0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+	0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+	0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+	0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+	0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+	0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+	0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+	0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+	0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+	0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+};
 
-/* whitening data */
-static const uint8_t WHITENING_DATA[] = {1, 1, 1, 0, 0, 0, 1, 1, 1, 0, 1, 1, 0, 0, 0, 1, 0, 1, 0, 0, 1, 0, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0, 1, 0, 0, 0, 0, 1, 0, 1, 1, 0, 1, 1, 1, 1, 0, 0, 1, 1, 1, 0, 0, 1, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 0, 0, 0, 0, 1, 1, 0, 1, 1, 0, 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 1, 1, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 1, 1, 1, 0, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1, 1};
+/* UAP from the 10 header data bits and from the HEC; reversing the HEC
+ * is linear, so uap_from_hec(data, hec) is the XOR of the two */
+static const uint8_t UAP_FROM_DATA[1024] = {
+	0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
+	0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8, 0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
+	0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4, 0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
+	0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
+	0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
+	0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea, 0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
+	0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6, 0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
+	0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee, 0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
+	0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1, 0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
+	0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
+	0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5, 0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
+	0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed, 0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
+	0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3, 0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
+	0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb, 0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
+	0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7, 0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
+	0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef, 0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff,
+	0xd3, 0x53, 0x93, 0x13, 0xf3, 0x73, 0xb3, 0x33, 0xc3, 0x43, 0x83, 0x03, 0xe3, 0x63, 0xa3, 0x23,
+	0xdb, 0x5b, 0x9b, 0x1b, 0xfb, 0x7b, 0xbb, 0x3b, 0xcb, 0x4b, 0x8b, 0x0b, 0xeb, 0x6b, 0xab, 0x2b,
+	0xd7, 0x57, 0x97, 0x17, 0xf7, 0x77, 0xb7, 0x37, 0xc7, 0x47, 0x87, 0x07, 0xe7, 0x67, 0xa7, 0x27,
+	0xdf, 0x5f, 0x9f, 0x1f, 0xff, 0x7f, 0xbf, 0x3f, 0xcf, 0x4f, 0x8f, 0x0f, 0xef, 0x6f, 0xaf, 0x2f,
+	0xd1, 0x51, 0x91, 0x11, 0xf1, 0x71, 0xb1, 0x31, 0xc1, 0x41, 0x81, 0x01, 0xe1, 0x61, 0xa1, 0x21,
+	0xd9, 0x59, 0x99, 0x19, 0xf9, 0x79, 0xb9, 0x39, 0xc9, 0x49, 0x89, 0x09, 0xe9, 0x69, 0xa9, 0x29,
+	0xd5, 0x55, 0x95, 0x15, 0xf5, 0x75, 0xb5, 0x35, 0xc5, 0x45, 0x85, 0x05, 0xe5, 0x65, 0xa5, 0x25,
+	0xdd, 0x5d, 0x9d, 0x1d, 0xfd, 0x7d, 0xbd, 0x3d, 0xcd, 0x4d, 0x8d, 0x0d, 0xed, 0x6d, 0xad, 0x2d,
+	0xd2, 0x52, 0x92, 0x12, 0xf2, 0x72, 0xb2, 0x32, 0xc2, 0x42, 0x82, 0x02, 0xe2, 0x62, 0xa2, 0x22,
+	0xda, 0x5a, 0x9a, 0x1a, 0xfa, 0x7a, 0xba, 0x3a, 0xca, 0x4a, 0x8a, 0x0a, 0xea, 0x6a, 0xaa, 0x2a,
+	0xd6, 0x56, 0x96, 0x16, 0xf6, 0x76, 0xb6, 0x36, 0xc6, 0x46, 0x86, 0x06, 0xe6, 0x66, 0xa6, 0x26,
+	0xde, 0x5e, 0x9e, 0x1e, 0xfe, 0x7e, 0xbe, 0x3e, 0xce, 0x4e, 0x8e, 0x0e, 0xee, 0x6e, 0xae, 0x2e,
+	0xd0, 0x50, 0x90, 0x10, 0xf0, 0x70, 0xb0, 0x30, 0xc0, 0x40, 0x80, 0x00, 0xe0, 0x60, 0xa0, 0x20,
+	0xd8, 0x58, 0x98, 0x18, 0xf8, 0x78, 0xb8, 0x38, 0xc8, 0x48, 0x88, 0x08, 0xe8, 0x68, 0xa8, 0x28,
+	0xd4, 0x54, 0x94, 0x14, 0xf4, 0x74, 0xb4, 0x34, 0xc4, 0x44, 0x84, 0x04, 0xe4, 0x64, 0xa4, 0x24,
+	0xdc, 0x5c, 0x9c, 0x1c, 0xfc, 0x7c, 0xbc, 0x3c, 0xcc, 0x4c, 0x8c, 0x0c, 0xec, 0x6c, 0xac, 0x2c,
+	0xba, 0x3a, 0xfa, 0x7a, 0x9a, 0x1a, 0xda, 0x5a, 0xaa, 0x2a, 0xea, 0x6a, 0x8a, 0x0a, 0xca, 0x4a,
+	0xb2, 0x32, 0xf2, 0x72, 0x92, 0x12, 0xd2, 0x52, 0xa2, 0x22, 0xe2, 0x62, 0x82, 0x02, 0xc2, 0x42,
+	0xbe, 0x3e, 0xfe, 0x7e, 0x9e, 0x1e, 0xde, 0x5e, 0xae, 0x2e, 0xee, 0x6e, 0x8e, 0x0e, 0xce, 0x4e,
+	0xb6, 0x36, 0xf6, 0x76, 0x96, 0x16, 0xd6, 0x56, 0xa6, 0x26, 0xe6, 0x66, 0x86, 0x06, 0xc6, 0x46,
+	0xb8, 0x38, 0xf8, 0x78, 0x98, 0x18, 0xd8, 0x58, 0xa8, 0x28, 0xe8, 0x68, 0x88, 0x08, 0xc8, 0x48,
+	0xb0, 0x30, 0xf0, 0x70, 0x90, 0x10, 0xd0, 0x50, 0xa0, 0x20, 0xe0, 0x60, 0x80, 0x00, 0xc0, 0x40,
+	0xbc, 0x3c, 0xfc, 0x7c, 0x9c, 0x1c, 0xdc, 0x5c, 0xac, 0x2c, 0xec, 0x6c, 0x8c, 0x0c, 0xcc, 0x4c,
+	0xb4, 0x34, 0xf4, 0x74, 0x94, 0x14, 0xd4, 0x54, 0xa4, 0x24, 0xe4, 0x64, 0x84, 0x04, 0xc4, 0x44,
+	0xbb, 0x3b, 0xfb, 0x7b, 0x9b, 0x1b, 0xdb, 0x5b, 0xab, 0x2b, 0xeb, 0x6b, 0x8b, 0x0b, 0xcb, 0x4b,
+	0xb3, 0x33, 0xf3, 0x73, 0x93, 0x13, 0xd3, 0x53, 0xa3, 0x23, 0xe3, 0x63, 0x83, 0x03, 0xc3, 0x43,
+	0xbf, 0x3f, 0xff, 0x7f, 0x9f, 0x1f, 0xdf, 0x5f, 0xaf, 0x2f, 0xef, 0x6f, 0x8f, 0x0f, 0xcf, 0x4f,
+	0xb7, 0x37, 0xf7, 0x77, 0x97, 0x17, 0xd7, 0x57, 0xa7, 0x27, 0xe7, 0x67, 0x87, 0x07, 0xc7, 0x47,
+	0xb9, 0x39, 0xf9, 0x79, 0x99, 0x19, 0xd9, 0x59, 0xa9, 0x29, 0xe9, 0x69, 0x89, 0x09, 0xc9, 0x49,
+	0xb1, 0x31, 0xf1, 0x71, 0x91, 0x11, 0xd1, 0x51, 0xa1, 0x21, 0xe1, 0x61, 0x81, 0x01, 0xc1, 0x41,
+	0xbd, 0x3d, 0xfd, 0x7d, 0x9d, 0x1d, 0xdd, 0x5d, 0xad, 0x2d, 0xed, 0x6d, 0x8d, 0x0d, 0xcd, 0x4d,
+	0xb5, 0x35, 0xf5, 0x75, 0x95, 0x15, 0xd5, 0x55, 0xa5, 0x25, 0xe5, 0x65, 0x85, 0x05, 0xc5, 0x45,
+	0x69, 0xe9, 0x29, 0xa9, 0x49, 0xc9, 0x09, 0x89, 0x79, 0xf9, 0x39, 0xb9, 0x59, 0xd9, 0x19, 0x99,
+	0x61, 0xe1, 0x21, 0xa1, 0x41, 0xc1, 0x01, 0x81, 0x71, 0xf1, 0x31, 0xb1, 0x51, 0xd1, 0x11, 0x91,
+	0x6d, 0xed, 0x2d, 0xad, 0x4d, 0xcd, 0x0d, 0x8d, 0x7d, 0xfd, 0x3d, 0xbd, 0x5d, 0xdd, 0x1d, 0x9d,
+	0x65, 0xe5, 0x25, 0xa5, 0x45, 0xc5, 0x05, 0x85, 0x75, 0xf5, 0x35, 0xb5, 0x55, 0xd5, 0x15, 0x95,
+	0x6b, 0xeb, 0x2b, 0xab, 0x4b, 0xcb, 0x0b, 0x8b, 0x7b, 0xfb, 0x3b, 0xbb, 0x5b, 0xdb, 0x1b, 0x9b,
+	0x63, 0xe3, 0x23, 0xa3, 0x43, 0xc3, 0x03, 0x83, 0x73, 0xf3, 0x33, 0xb3, 0x53, 0xd3, 0x13, 0x93,
+	0x6f, 0xef, 0x2f, 0xaf, 0x4f, 0xcf, 0x0f, 0x8f, 0x7f, 0xff, 0x3f, 0xbf, 0x5f, 0xdf, 0x1f, 0x9f,
+	0x67, 0xe7, 0x27, 0xa7, 0x47, 0xc7, 0x07, 0x87, 0x77, 0xf7, 0x37, 0xb7, 0x57, 0xd7, 0x17, 0x97,
+	0x68, 0xe8, 0x28, 0xa8, 0x48, 0xc8, 0x08, 0x88, 0x78, 0xf8, 0x38, 0xb8, 0x58, 0xd8, 0x18, 0x98,
+	0x60, 0xe0, 0x20, 0xa0, 0x40, 0xc0, 0x00, 0x80, 0x70, 0xf0, 0x30, 0xb0, 0x50, 0xd0, 0x10, 0x90,
+	0x6c, 0xec, 0x2c, 0xac, 0x4c, 0xcc, 0x0c, 0x8c, 0x7c, 0xfc, 0x3c, 0xbc, 0x5c, 0xdc, 0x1c, 0x9c,
+	0x64, 0xe4, 0x24, 0xa4, 0x44, 0xc4, 0x04, 0x84, 0x74, 0xf4, 0x34, 0xb4, 0x54, 0xd4, 0x14, 0x94,
+	0x6a, 0xea, 0x2a, 0xaa, 0x4a, 0xca, 0x0a, 0x8a, 0x7a, 0xfa, 0x3a, 0xba, 0x5a, 0xda, 0x1a, 0x9a,
+	0x62, 0xe2, 0x22, 0xa2, 0x42, 0xc2, 0x02, 0x82, 0x72, 0xf2, 0x32, 0xb2, 0x52, 0xd2, 0x12, 0x92,
+	0x6e, 0xee, 0x2e, 0xae, 0x4e, 0xce, 0x0e, 0x8e, 0x7e, 0xfe, 0x3e, 0xbe, 0x5e, 0xde, 0x1e, 0x9e,
+	0x66, 0xe6, 0x26, 0xa6, 0x46, 0xc6, 0x06, 0x86, 0x76, 0xf6, 0x36, 0xb6, 0x56, 0xd6, 0x16, 0x96
+};
+
+static const uint8_t UAP_FROM_HEC[256] = {
+	0x00, 0x5d, 0xfd, 0xa0, 0xad, 0xf0, 0x50, 0x0d, 0x85, 0xd8, 0x78, 0x25, 0x28, 0x75, 0xd5, 0x88,
+	0x91, 0xcc, 0x6c, 0x31, 0x3c, 0x61, 0xc1, 0x9c, 0x14, 0x49, 0xe9, 0xb4, 0xb9, 0xe4, 0x44, 0x19,
+	0x9b, 0xc6, 0x66, 0x3b, 0x36, 0x6b, 0xcb, 0x96, 0x1e, 0x43, 0xe3, 0xbe, 0xb3, 0xee, 0x4e, 0x13,
+	0x0a, 0x57, 0xf7, 0xaa, 0xa7, 0xfa, 0x5a, 0x07, 0x8f, 0xd2, 0x72, 0x2f, 0x22, 0x7f, 0xdf, 0x82,
+	0x9e, 0xc3, 0x63, 0x3e, 0x33, 0x6e, 0xce, 0x93, 0x1b, 0x46, 0xe6, 0xbb, 0xb6, 0xeb, 0x4b, 0x16,
+	0x0f, 0x52, 0xf2, 0xaf, 0xa2, 0xff, 0x5f, 0x02, 0x8a, 0xd7, 0x77, 0x2a, 0x27, 0x7a, 0xda, 0x87,
+	0x05, 0x58, 0xf8, 0xa5, 0xa8, 0xf5, 0x55, 0x08, 0x80, 0xdd, 0x7d, 0x20, 0x2d, 0x70, 0xd0, 0x8d,
+	0x94, 0xc9, 0x69, 0x34, 0x39, 0x64, 0xc4, 0x99, 0x11, 0x4c, 0xec, 0xb1, 0xbc, 0xe1, 0x41, 0x1c,
+	0x4f, 0x12, 0xb2, 0xef, 0xe2, 0xbf, 0x1f, 0x42, 0xca, 0x97, 0x37, 0x6a, 0x67, 0x3a, 0x9a, 0xc7,
+	0xde, 0x83, 0x23, 0x7e, 0x73, 0x2e, 0x8e, 0xd3, 0x5b, 0x06, 0xa6, 0xfb, 0xf6, 0xab, 0x0b, 0x56,
+	0xd4, 0x89, 0x29, 0x74, 0x79, 0x24, 0x84, 0xd9, 0x51, 0x0c, 0xac, 0xf1, 0xfc, 0xa1, 0x01, 0x5c,
+	0x45, 0x18, 0xb8, 0xe5, 0xe8, 0xb5, 0x15, 0x48, 0xc0, 0x9d, 0x3d, 0x60, 0x6d, 0x30, 0x90, 0xcd,
+	0xd1, 0x8c, 0x2c, 0x71, 0x7c, 0x21, 0x81, 0xdc, 0x54, 0x09, 0xa9, 0xf4, 0xf9, 0xa4, 0x04, 0x59,
+	0x40, 0x1d, 0xbd, 0xe0, 0xed, 0xb0, 0x10, 0x4d, 0xc5, 0x98, 0x38, 0x65, 0x68, 0x35, 0x95, 0xc8,
+	0x4a, 0x17, 0xb7, 0xea, 0xe7, 0xba, 0x1a, 0x47, 0xcf, 0x92, 0x32, 0x6f, 0x62, 0x3f, 0x9f, 0xc2,
+	0xdb, 0x86, 0x26, 0x7b, 0x76, 0x2b, 0x8b, 0xd6, 0x5e, 0x03, 0xa3, 0xfe, 0xf3, 0xae, 0x0e, 0x53
+};
+
+/* bits of a byte, one per char */
+static const uint8_t BIT_SPREAD[256][8] = {
+	{0,0,0,0,0,0,0,0}, {1,0,0,0,0,0,0,0}, {0,1,0,0,0,0,0,0}, {1,1,0,0,0,0,0,0}, {0,0,1,0,0,0,0,0}, {1,0,1,0,0,0,0,0}, {0,1,1,0,0,0,0,0}, {1,1,1,0,0,0,0,0},
+	{0,0,0,1,0,0,0,0}, {1,0,0,1,0,0,0,0}, {0,1,0,1,0,0,0,0}, {1,1,0,1,0,0,0,0}, {0,0,1,1,0,0,0,0}, {1,0,1,1,0,0,0,0}, {0,1,1,1,0,0,0,0}, {1,1,1,1,0,0,0,0},
+	{0,0,0,0,1,0,0,0}, {1,0,0,0,1,0,0,0}, {0,1,0,0,1,0,0,0}, {1,1,0,0,1,0,0,0}, {0,0,1,0,1,0,0,0}, {1,0,1,0,1,0,0,0}, {0,1,1,0,1,0,0,0}, {1,1,1,0,1,0,0,0},
+	{0,0,0,1,1,0,0,0}, {1,0,0,1,1,0,0,0}, {0,1,0,1,1,0,0,0}, {1,1,0,1,1,0,0,0}, {0,0,1,1,1,0,0,0}, {1,0,1,1,1,0,0,0}, {0,1,1,1,1,0,0,0}, {1,1,1,1,1,0,0,0},
+	{0,0,0,0,0,1,0,0}, {1,0,0,0,0,1,0,0}, {0,1,0,0,0,1,0,0}, {1,1,0,0,0,1,0,0}, {0,0,1,0,0,1,0,0}, {1,0,1,0,0,1,0,0}, {0,1,1,0,0,1,0,0}, {1,1,1,0,0,1,0,0},
+	{0,0,0,1,0,1,0,0}, {1,0,0,1,0,1,0,0}, {0,1,0,1,0,1,0,0}, {1,1,0,1,0,1,0,0}, {0,0,1,1,0,1,0,0}, {1,0,1,1,0,1,0,0}, {0,1,1,1,0,1,0,0}, {1,1,1,1,0,1,0,0},
+	{0,0,0,0,1,1,0,0}, {1,0,0,0,1,1,0,0}, {0,1,0,0,1,1,0,0}, {1,1,0,0,1,1,0,0}, {0,0,1,0,1,1,0,0}, {1,0,1,0,1,1,0,0}, {0,1,1,0,1,1,0,0}, {1,1,1,0,1,1,0,0},
+	{0,0,0,1,1,1,0,0}, {1,0,0,1,1,1,0,0}, {0,1,0,1,1,1,0,0}, {1,1,0,1,1,1,0,0}, {0,0,1,1,1,1,0,0}, {1,0,1,1,1,1,0,0}, {0,1,1,1,1,1,0,0}, {1,1,1,1,1,1,0,0},
+	{0,0,0,0,0,0,1,0}, {1,0,0,0,0,0,1,0}, {0,1,0,0,0,0,1,0}, {1,1,0,0,0,0,1,0}, {0,0,1,0,0,0,1,0}, {1,0,1,0,0,0,1,0}, {0,1,1,0,0,0,1,0}, {1,1,1,0,0,0,1,0},
+	{0,0,0,1,0,0,1,0}, {1,0,0,1,0,0,1,0}, {0,1,0,1,0,0,1,0}, {1,1,0,1,0,0,1,0}, {0,0,1,1,0,0,1,0}, {1,0,1,1,0,0,1,0}, {0,1,1,1,0,0,1,0}, {1,1,1,1,0,0,1,0},
+	{0,0,0,0,1,0,1,0}, {1,0,0,0,1,0,1,0}, {0,1,0,0,1,0,1,0}, {1,1,0,0,1,0,1,0}, {0,0,1,0,1,0,1,0}, {1,0,1,0,1,0,1,0}, {0,1,1,0,1,0,1,0}, {1,1,1,0,1,0,1,0},
+	{0,0,0,1,1,0,1,0}, {1,0,0,1,1,0,1,0}, {0,1,0,1,1,0,1,0}, {1,1,0,1,1,0,1,0}, {0,0,1,1,1,0,1,0}, {1,0,1,1,1,0,1,0}, {0,1,1,1,1,0,1,0}, {1,1,1,1,1,0,1,0},
+	{0,0,0,0,0,1,1,0}, {1,0,0,0,0,1,1,0}, {0,1,0,0,0,1,1,0}, {1,1,0,0,0,1,1,0}, {0,0,1,0,0,1,1,0}, {1,0,1,0,0,1,1,0}, {0,1,1,0,0,1,1,0}, {1,1,1,0,0,1,1,0},
+	{0,0,0,1,0,1,1,0}, {1,0,0,1,0,1,1,0}, {0,1,0,1,0,1,1,0}, {1,1,0,1,0,1,1,0}, {0,0,1,1,0,1,1,0}, {1,0,1,1,0,1,1,0}, {0,1,1,1,0,1,1,0}, {1,1,1,1,0,1,1,0},
+	{0,0,0,0,1,1,1,0}, {1,0,0,0,1,1,1,0}, {0,1,0,0,1,1,1,0}, {1,1,0,0,1,1,1,0}, {0,0,1,0,1,1,1,0}, {1,0,1,0,1,1,1,0}, {0,1,1,0,1,1,1,0}, {1,1,1,0,1,1,1,0},
+	{0,0,0,1,1,1,1,0}, {1,0,0,1,1,1,1,0}, {0,1,0,1,1,1,1,0}, {1,1,0,1,1,1,1,0}, {0,0,1,1,1,1,1,0}, {1,0,1,1,1,1,1,0}, {0,1,1,1,1,1,1,0}, {1,1,1,1,1,1,1,0},
+	{0,0,0,0,0,0,0,1}, {1,0,0,0,0,0,0,1}, {0,1,0,0,0,0,0,1}, {1,1,0,0,0,0,0,1}, {0,0,1,0,0,0,0,1}, {1,0,1,0,0,0,0,1}, {0,1,1,0,0,0,0,1}, {1,1,1,0,0,0,0,1},
+	{0,0,0,1,0,0,0,1}, {1,0,0,1,0,0,0,1}, {0,1,0,1,0,0,0,1}, {1,1,0,1,0,0,0,1}, {0,0,1,1,0,0,0,1}, {1,0,1,1,0,0,0,1}, {0,1,1,1,0,0,0,1}, {1,1,1,1,0,0,0,1},
+	{0,0,0,0,1,0,0,1}, {1,0,0,0,1,0,0,1}, {0,1,0,0,1,0,0,1}, {1,1,0,0,1,0,0,1}, {0,0,1,0,1,0,0,1}, {1,0,1,0,1,0,0,1}, {0,1,1,0,1,0,0,1}, {1,1,1,0,1,0,0,1},
+	{0,0,0,1,1,0,0,1}, {1,0,0,1,1,0,0,1}, {0,1,0,1,1,0,0,1}, {1,1,0,1,1,0,0,1}, {0,0,1,1,1,0,0,1}, {1,0,1,1,1,0,0,1}, {0,1,1,1,1,0,0,1}, {1,1,1,1,1,0,0,1},
+	{0,0,0,0,0,1,0,1}, {1,0,0,0,0,1,0,1}, {0,1,0,0,0,1,0,1}, {1,1,0,0,0,1,0,1}, {0,0,1,0,0,1,0,1}, {1,0,1,0,0,1,0,1}, {0,1,1,0,0,1,0,1}, {1,1,1,0,0,1,0,1},
+	{0,0,0,1,0,1,0,1}, {1,0,0,1,0,1,0,1}, {0,1,0,1,0,1,0,1}, {1,1,0,1,0,1,0,1}, {0,0,1,1,0,1,0,1}, {1,0,1,1,0,1,0,1}, {0,1,1,1,0,1,0,1}, {1,1,1,1,0,1,0,1},
+	{0,0,0,0,1,1,0,1}, {1,0,0,0,1,1,0,1}, {0,1,0,0,1,1,0,1}, {1,1,0,0,1,1,0,1}, {0,0,1,0,1,1,0,1}, {1,0,1,0,1,1,0,1}, {0,1,1,0,1,1,0,1}, {1,1,1,0,1,1,0,1},
+	{0,0,0,1,1,1,0,1}, {1,0,0,1,1,1,0,1}, {0,1,0,1,1,1,0,1}, {1,1,0,1,1,1,0,1}, {0,0,1,1,1,1,0,1}, {1,0,1,1,1,1,0,1}, {0,1,1,1,1,1,0,1}, {1,1,1,1,1,1,0,1},
+	{0,0,0,0,0,0,1,1}, {1,0,0,0,0,0,1,1}, {0,1,0,0,0,0,1,1}, {1,1,0,0,0,0,1,1}, {0,0,1,0,0,0,1,1}, {1,0,1,0,0,0,1,1}, {0,1,1,0,0,0,1,1}, {1,1,1,0,0,0,1,1},
+	{0,0,0,1,0,0,1,1}, {1,0,0,1,0,0,1,1}, {0,1,0,1,0,0,1,1}, {1,1,0,1,0,0,1,1}, {0,0,1,1,0,0,1,1}, {1,0,1,1,0,0,1,1}, {0,1,1,1,0,0,1,1}, {1,1,1,1,0,0,1,1},
+	{0,0,0,0,1,0,1,1}, {1,0,0,0,1,0,1,1}, {0,1,0,0,1,0,1,1}, {1,1,0,0,1,0,1,1}, {0,0,1,0,1,0,1,1}, {1,0,1,0,1,0,1,1}, {0,1,1,0,1,0,1,1}, {1,1,1,0,1,0,1,1},
+	{0,0,0,1,1,0,1,1}, {1,0,0,1,1,0,1,1}, {0,1,0,1,1,0,1,1}, {1,1,0,1,1,0,1,1}, {0,0,1,1,1,0,1,1}, {1,0,1,1,1,0,1,1}, {0,1,1,1,1,0,1,1}, {1,1,1,1,1,0,1,1},
+	{0,0,0,0,0,1,1,1}, {1,0,0,0,0,1,1,1}, {0,1,0,0,0,1,1,1}, {1,1,0,0,0,1,1,1}, {0,0,1,0,0,1,1,1}, {1,0,1,0,0,1,1,1}, {0,1,1,0,0,1,1,1}, {1,1,1,0,0,1,1,1},
+	{0,0,0,1,0,1,1,1}, {1,0,0,1,0,1,1,1}, {0,1,0,1,0,1,1,1}, {1,1,0,1,0,1,1,1}, {0,0,1,1,0,1,1,1}, {1,0,1,1,0,1,1,1}, {0,1,1,1,0,1,1,1}, {1,1,1,1,0,1,1,1},
+	{0,0,0,0,1,1,1,1}, {1,0,0,0,1,1,1,1}, {0,1,0,0,1,1,1,1}, {1,1,0,0,1,1,1,1}, {0,0,1,0,1,1,1,1}, {1,0,1,0,1,1,1,1}, {0,1,1,0,1,1,1,1}, {1,1,1,0,1,1,1,1},
+	{0,0,0,1,1,1,1,1}, {1,0,0,1,1,1,1,1}, {0,1,0,1,1,1,1,1}, {1,1,0,1,1,1,1,1}, {0,0,1,1,1,1,1,1}, {1,0,1,1,1,1,1,1}, {0,1,1,1,1,1,1,1}, {1,1,1,1,1,1,1,1}};
 
 /* lookup table for barker code hamming distance */
 static const uint8_t BARKER_DISTANCE[] = {
@@ -126,34 +368,86 @@ static const uint64_t barker_correct[] = {
 
 static const uint64_t pn = 0x83848D96BBCC54FCULL;
 
-static const uint16_t fec23_gen_matrix[] = {
-	0x2c01, 0x5802, 0x1c04, 0x3808, 0x7010,
-	0x4c20, 0x3440, 0x6880, 0x7d00, 0x5600};
+/* Syndrome table: open addressing with linear probing, all entries in
+ * one allocation. A zero syndrome (a good codeword) is never looked up,
+ * so it marks an empty slot. */
+typedef struct {
+	uint64_t syndrome;
+	uint64_t error;
+} syndrome_entry;
 
 typedef struct {
-    uint64_t syndrome; /* key */
-    uint64_t error;             
-    UT_hash_handle hh;
-} syndrome_struct;
+	uint64_t mask;         /* number of slots - 1, a power of two */
+	int max_errors;
+	syndrome_entry *entries;
+} syndrome_table;
 
-static syndrome_struct *syndrome_map = NULL;
+static syndrome_table *syndromes = NULL;
 
-static void add_syndrome(uint64_t syndrome, uint64_t error)
+/* Number of error patterns with 1 to n bit errors in the 58 bits the
+ * syndrome map covers */
+static uint64_t syndrome_count(int n)
 {
-	syndrome_struct *s;
-	s = malloc(sizeof(syndrome_struct));
-	s->syndrome = syndrome;
-	s->error = error;
-	
-    HASH_ADD(hh, syndrome_map, syndrome, 8, s);
+	uint64_t count = 0, level = 1;
+	int i;
+
+	for (i = 1; i <= n; i++) {
+		level = level * (58 - i + 1) / i;
+		count += level;
+	}
+	return count;
+}
+
+static inline uint64_t syndrome_slot(const syndrome_table *table, uint64_t syndrome)
+{
+	return (syndrome * 0x9e3779b97f4a7c15ULL >> 20) & table->mask;
 }
 
-static syndrome_struct *find_syndrome(uint64_t syndrome)
+static void add_syndrome(syndrome_table *table, uint64_t syndrome, uint64_t error)
 {
-    syndrome_struct *s;
+	uint64_t i = syndrome_slot(table, syndrome);
+
+	uint64_t cur;
+
+	if (!syndrome)
+		return;
+	/* several threads may be filling the table: claim a slot with a
+	 * compare-and-swap on its syndrome */
+	for (;;) {
+		cur = __atomic_load_n(&table->entries[i].syndrome, __ATOMIC_RELAXED);
+		if (cur == 0 && !__atomic_compare_exchange_n(&table->entries[i].syndrome,
+				&cur, syndrome, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		if (cur == 0 || cur == syndrome)
+			break;
+		i = (i + 1) & table->mask;
+	}
+	table->entries[i].error = error;
+}
 
-    HASH_FIND(hh, syndrome_map, &syndrome, 8, s);  
-    return s;
+static syndrome_entry *find_syndrome_probes(uint64_t syndrome, int *probes)
+{
+	syndrome_table *table = __atomic_load_n(&syndromes, __ATOMIC_ACQUIRE);
+	uint64_t i;
+
+	*probes = 0;
+	if (table == NULL)
+		return NULL;
+	i = syndrome_slot(table, syndrome);
+	while (table->entries[i].syndrome) {
+		++*probes;
+		if (table->entries[i].syndrome == syndrome)
+			return &table->entries[i];
+		i = (i + 1) & table->mask;
+	}
+	return NULL;
+}
+
+static syndrome_entry *find_syndrome(uint64_t syndrome)
+{
+	int probes;
+
+	return find_syndrome_probes(syndrome, &probes);
 }
 
 static uint64_t gen_syndrome(uint64_t codeword)
@@ -170,7 +464,11 @@ static uint64_t gen_syndrome(uint64_t codeword)
 	return syndrome;
 }
 
-static void cycle(uint64_t error, int start, int depth, uint64_t codeword)
+typedef void (*syndrome_visitor)(void *arg, uint64_t syndrome, uint64_t error);
+
+/* Visit every error pattern of 'depth' more bits above bit 'start' */
+static void cycle(uint64_t error, int start, int depth, uint64_t codeword,
+		  syndrome_visitor visit, void *arg)
 {
 	uint64_t new_error, syndrome, base;
 	int i;
@@ -181,19 +479,288 @@ static void cycle(uint64_t error, int start, int depth, uint64_t codeword)
 		new_error = (base << i);
 		new_error |= error;
 		if (depth)
-			cycle(new_error, i + 1, depth, codeword);
+			cycle(new_error, i + 1, depth, codeword, visit, arg);
 		else {
 			syndrome = gen_syndrome(codeword ^ new_error);
-			add_syndrome(syndrome, new_error);
+			visit(arg, syndrome, new_error);
 		}
 	}
 }
 
-static void gen_syndrome_map(int bit_errors)
+static void visit_add(void *arg, uint64_t syndrome, uint64_t error)
+{
+	add_syndrome((syndrome_table *) arg, syndrome, error);
+}
+
+static int syndrome_threads = 0;
+static int syndrome_lazy = 0;
+
+void btbb_set_syndrome_threads(int threads)
+{
+	syndrome_threads = threads;
+}
+
+void btbb_set_syndrome_lazy(int lazy)
+{
+	syndrome_lazy = lazy;
+}
+
+typedef struct {
+	syndrome_table *table;
+	int bit_errors;
+	int next_task;
+} syndrome_build;
+
+/* The error patterns are split into tasks by number of errors and lowest
+ * error bit. Fewest errors go first, so that the most common syndromes
+ * tend to sit in their home slots. */
+static void *syndrome_worker(void *arg)
+{
+	syndrome_build *build = (syndrome_build *) arg;
+	uint64_t error;
+	int task, level;
+
+	while ((task = __atomic_fetch_add(&build->next_task, 1, __ATOMIC_RELAXED))
+	       < build->bit_errors * 58) {
+		level = task / 58 + 1;
+		error = 1ULL << (task % 58);
+		if (level == 1)
+			add_syndrome(build->table, gen_syndrome(DEFAULT_AC ^ error), error);
+		else
+			cycle(error, task % 58 + 1, level - 1, DEFAULT_AC,
+			      visit_add, build->table);
+	}
+	return NULL;
+}
+
+static syndrome_table *gen_syndrome_map(int bit_errors)
 {
+	syndrome_table *table;
+	syndrome_build build;
+	pthread_t threads[MAX_SYNDROME_THREADS];
+	uint64_t slots = 64;
+	int i, num_threads;
+
+	/* keep the load factor under 3/4 */
+	while (slots * 3 < syndrome_count(bit_errors) * 4)
+		slots <<= 1;
+
+	table = malloc(sizeof(syndrome_table));
+	if (table == NULL)
+		return NULL;
+	table->mask = slots - 1;
+	table->max_errors = bit_errors;
+	table->entries = calloc(slots, sizeof(syndrome_entry));
+	if (table->entries == NULL) {
+		free(table);
+		return NULL;
+	}
+
+	num_threads = syndrome_threads;
+	if (num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (bit_errors <= 2)
+		num_threads = 1;  /* not worth a thread */
+	num_threads = MIN(MAX(num_threads, 1), MAX_SYNDROME_THREADS);
+
+	build.table = table;
+	build.bit_errors = bit_errors;
+	build.next_task = 0;
+	for (i = 1; i < num_threads; i++)
+		if (pthread_create(&threads[i], NULL, syndrome_worker, &build) != 0)
+			break;
+	num_threads = i;
+	syndrome_worker(&build);
+	for (i = 1; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	return table;
+}
+
+/* Syndrome table file: a header followed by the table's slots, as laid
+ * out in memory, so the file can be mapped and used in place. Bump
+ * SYNDROME_FILE_VERSION whenever the layout or syndrome_slot() changes. */
+#define SYNDROME_FILE_MAGIC   0x4e59534242544242ULL /* "BBTBBSYN" */
+#define SYNDROME_FILE_VERSION 1
+
+typedef struct {
+	uint64_t magic;        /* also catches a file from other endianness */
+	uint32_t version;
+	uint32_t max_errors;
+	uint64_t slots;
+	uint64_t check;        /* gen_syndrome(DEFAULT_AC ^ 1) */
+	uint8_t  pad[32];      /* keep entries 64-byte aligned */
+} syndrome_file_header;
+
+static const char *syndrome_file = NULL;
+
+void btbb_set_syndrome_file(const char *path)
+{
+	syndrome_file = path;
+}
+
+/* Map a table file read-only. Fails if it is missing, malformed, or
+ * does not cover max_errors. */
+static syndrome_table *map_syndrome_file(const char *path, int max_errors)
+{
+	syndrome_file_header *header;
+	syndrome_table *table;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(syndrome_file_header)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	header = (syndrome_file_header *) map;
+	if (header->magic != SYNDROME_FILE_MAGIC
+	    || header->version != SYNDROME_FILE_VERSION
+	    || header->max_errors < (uint32_t) max_errors
+	    || header->slots == 0
+	    || (header->slots & (header->slots - 1))
+	    || header->check != gen_syndrome(DEFAULT_AC ^ 1)
+	    || (uint64_t) st.st_size != sizeof(syndrome_file_header)
+	                                + header->slots * sizeof(syndrome_entry)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	table = malloc(sizeof(syndrome_table));
+	if (table == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	table->mask = header->slots - 1;
+	table->max_errors = header->max_errors;
+	table->entries = (syndrome_entry *) (header + 1);
+	return table;
+}
+
+static int write_syndrome_file(const char *path, const syndrome_table *table)
+{
+	syndrome_file_header header;
+	char *tmp;
+	FILE *fp;
+	int fd, ok;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = SYNDROME_FILE_MAGIC;
+	header.version = SYNDROME_FILE_VERSION;
+	header.max_errors = table->max_errors;
+	header.slots = table->mask + 1;
+	header.check = gen_syndrome(DEFAULT_AC ^ 1);
+
+	/* write a uniquely named temporary file and rename it, so a reader
+	 * never maps a partial table and concurrent writers never share one */
+	tmp = malloc(strlen(path) + 11);
+	if (tmp == NULL)
+		return -1;
+	sprintf(tmp, "%s.tmpXXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		return -1;
+	}
+	fchmod(fd, 0644);
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& fwrite(table->entries, sizeof(syndrome_entry), header.slots, fp) == header.slots;
+	ok = (fclose(fp) == 0) && ok;
+	if (ok)
+		ok = rename(tmp, path) == 0;
+	if (!ok)
+		unlink(tmp);
+	free(tmp);
+	return ok ? 0 : -1;
+}
+
+int btbb_write_syndrome_file(const char *path, int max_ac_errors)
+{
+	syndrome_table *table;
+	int r;
+
+	if ((max_ac_errors < 1) || (max_ac_errors > AC_ERROR_LIMIT))
+		return -1;
+	table = gen_syndrome_map(max_ac_errors);
+	if (table == NULL)
+		return -1;
+	r = write_syndrome_file(path, table);
+	free(table->entries);
+	free(table);
+	return r;
+}
+
+typedef struct {
+	uint64_t lookups;
+	uint64_t probes;
+	uint64_t misses;
+} syndrome_probe_stats;
+
+static void visit_probe(void *arg, uint64_t syndrome, uint64_t error)
+{
+	syndrome_probe_stats *stats = (syndrome_probe_stats *) arg;
+	syndrome_entry *entry;
+	int probes;
+
+	entry = find_syndrome_probes(syndrome, &probes);
+	stats->lookups++;
+	stats->probes += probes;
+	if (entry == NULL || entry->error != error)
+		stats->misses++;
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+void btbb_print_syndrome_stats(FILE *fp)
+{
+	syndrome_table *table = __atomic_load_n(&syndromes, __ATOMIC_ACQUIRE);
+	syndrome_probe_stats stats;
+	struct timespec start;
+	double ns;
 	int i;
-	for(i = 1; i <= bit_errors; i++)
-		cycle(0, 0, i, DEFAULT_AC);
+
+	if (table == NULL) {
+		fprintf(fp, "syndrome table: not built\n");
+		return;
+	}
+	fprintf(fp, "syndrome table: %d errors, %llu entries in %llu slots, %llu bytes\n",
+		table->max_errors,
+		(unsigned long long) syndrome_count(table->max_errors),
+		(unsigned long long) table->mask + 1,
+		(unsigned long long) (table->mask + 1) * sizeof(syndrome_entry));
+
+	for (i = 1; i <= table->max_errors; i++) {
+		memset(&stats, 0, sizeof(stats));
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		cycle(0, 0, i, DEFAULT_AC, visit_probe, &stats);
+		ns = elapsed_ns(&start);
+		fprintf(fp, "  %d errors: %llu syndromes, %.2f probes/lookup, %.1f ns/pattern, %llu missing\n",
+			i, (unsigned long long) stats.lookups,
+			(double) stats.probes / stats.lookups,
+			ns / stats.lookups,
+			(unsigned long long) stats.misses);
+	}
 }
 
 /* Generate Sync Word from an LAP */
@@ -287,8 +854,46 @@ char *btbb_get_version(void) {
 	return VERSION;
 }
 
+/* Map the syndrome table from syndrome_file, creating the file if
+ * needed, or else build it in memory */
+static syndrome_table *load_syndrome_table(int max_ac_errors)
+{
+	syndrome_table *table = NULL;
+
+	if (syndrome_file) {
+		table = map_syndrome_file(syndrome_file, max_ac_errors);
+		if (table == NULL) {
+			if (btbb_write_syndrome_file(syndrome_file, max_ac_errors) < 0)
+				fprintf(stderr, "%s: unable to write %s\n",
+					__FUNCTION__, syndrome_file);
+			else
+				table = map_syndrome_file(syndrome_file, max_ac_errors);
+		}
+	}
+	if (table == NULL)
+		table = gen_syndrome_map(max_ac_errors);
+	return table;
+}
+
+/* Lazy mode: build the full table while capture runs on the small one,
+ * then swap it in. The small table is never freed, since a search may
+ * still be looking at it. */
+static void *syndrome_background(void *arg)
+{
+	syndrome_table *table = load_syndrome_table((int)(intptr_t) arg);
+
+	if (table)
+		__atomic_store_n(&syndromes, table, __ATOMIC_RELEASE);
+	else
+		fprintf(stderr, "%s: unable to allocate syndrome table\n",
+			__FUNCTION__);
+	return NULL;
+}
+
 int btbb_init(int max_ac_errors)
 {
+	pthread_t thread;
+
 	/* Sanity check max_ac_errors. */
 	if ( (max_ac_errors < 0) || (max_ac_errors > AC_ERROR_LIMIT) ) {
 		fprintf(stderr, "%s: max_ac_errors out of range\n",
@@ -296,19 +901,61 @@ int btbb_init(int max_ac_errors)
 		return -1;
 	}
 
-	if ((syndrome_map == NULL) && (max_ac_errors))
-		gen_syndrome_map(max_ac_errors);
+	if ((__atomic_load_n(&syndromes, __ATOMIC_ACQUIRE) == NULL) && (max_ac_errors)) {
+		if (syndrome_file)
+			syndromes = map_syndrome_file(syndrome_file, max_ac_errors);
+		if ((syndromes == NULL) && syndrome_lazy && (max_ac_errors > 2)) {
+			/* start with up to 2 errors, the rest follows */
+			syndromes = gen_syndrome_map(2);
+			if (syndromes && (pthread_create(&thread, NULL, syndrome_background,
+					(void *)(intptr_t) max_ac_errors) == 0))
+				pthread_detach(thread);
+		} else if (syndromes == NULL) {
+			syndromes = load_syndrome_table(max_ac_errors);
+		}
+		if (syndromes == NULL) {
+			fprintf(stderr, "%s: unable to allocate syndrome table\n",
+				__FUNCTION__);
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
+/* Finish storing 'length' packed symbols: clear the bits past them and
+ * the pad word, and start the payload in the words that follow */
+static void symbols_done(btbb_packet *pkt, int length)
+{
+	int words = SYMBOL_WORDS(length);
+
+	if (length & 63)
+		pkt->symbols[length >> 6] &= (1ULL << (length & 63)) - 1;
+	pkt->symbols[words - 1] = 0;
+	pkt->payload = (uint8_t *) &pkt->arena[words];
+	pkt->length = length;
+}
+
 btbb_packet *
 btbb_packet_new(void)
 {
-	btbb_packet *pkt = (btbb_packet *)calloc(1, sizeof(btbb_packet));
-	if(pkt)
+	btbb_packet *pkt = (btbb_packet *)packet_pool_get(PACKET_POOL_BTBB);
+
+	if (pkt) {
+		/* reset the header fields only: the symbols are overwritten
+		 * when the packet's data is set, and nothing reads the payload
+		 * past what the decoders wrote */
+		memset(pkt, 0, offsetof(btbb_packet, symbols));
+	} else if (posix_memalign((void **)&pkt, BTBB_PACKET_ALIGN, sizeof(btbb_packet)) == 0) {
+		memset(pkt, 0, sizeof(btbb_packet));
+	} else {
+		pkt = NULL;
+	}
+	if(pkt) {
 		pkt->refcount = 1;
-	else
+		pkt->symbols = pkt->arena;
+		symbols_done(pkt, 0);
+	} else
 		fprintf(stderr, "Unable to allocate packet");
 	return pkt;
 }
@@ -323,7 +970,7 @@ void
 btbb_packet_unref(btbb_packet *pkt)
 {
 	pkt->refcount--;
-	if (pkt->refcount == 0)
+	if (pkt->refcount == 0 && !packet_pool_put(PACKET_POOL_BTBB, pkt))
 		free(pkt);
 }
 
@@ -376,9 +1023,61 @@ uint8_t btbb_packet_get_ac_errors(const btbb_packet *pkt) {
 	return pkt->ac_errors;
 }
 
+/* Correct the barker code of a candidate sync word in place, and
+ * return the syndrome of the result */
+static inline uint64_t barker_syndrome(uint64_t *syncword)
+{
+	uint64_t corrected_barker;
+
+	/* correct the barker code with a simple comparison */
+	corrected_barker = barker_correct[(uint8_t)(*syncword >> 57)];
+	*syncword = (*syncword & 0x01ffffffffffffffULL) | corrected_barker;
+
+	return gen_syndrome(*syncword ^ pn);
+}
+
+/* Correct a sync word with the given syndrome in place. Returns the
+ * number of bit errors corrected, 0xff if it could not be corrected. */
+static uint8_t correct_with_syndrome(uint64_t *syncword, uint64_t syndrome)
+{
+	syndrome_entry *errors;
+
+	/* Zero syndrome -> good codeword. */
+	if (!syndrome)
+		return 0;
+
+	/* Try to fix errors in bad codeword. */
+	errors = find_syndrome(syndrome);
+	if (errors == NULL)
+		return 0xff;  // fail
+	*syncword ^= errors->error;
+	return count_bits(errors->error);
+}
+
+/* Correct a candidate sync word in place. Returns the number of bit
+ * errors corrected, 0xff if it could not be corrected. */
+static uint8_t correct_syncword(uint64_t *syncword)
+{
+	return correct_with_syndrome(syncword, barker_syndrome(syncword));
+}
+
+/* barker_syndrome() for 'n' candidate sync words in one pass, starting
+ * the fetch of every table slot a lookup will need, so that the misses
+ * overlap instead of coming one per candidate */
+static void barker_syndromes(uint64_t *syncwords, uint64_t *out, int n)
+{
+	syndrome_table *table = __atomic_load_n(&syndromes, __ATOMIC_ACQUIRE);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		out[i] = barker_syndrome(&syncwords[i]);
+		if (out[i] && table)
+			__builtin_prefetch(&table->entries[syndrome_slot(table, out[i])]);
+	}
+}
+
 int promiscuous_packet_search(char *stream, int search_length, uint32_t *lap, int max_ac_errors, uint8_t *ac_errors) {
-	uint64_t syncword, codeword, syndrome, corrected_barker, ac;
-	syndrome_struct *errors;
+	uint64_t syncword;
 	char *symbols;
 	int count, offset = -1;
 	
@@ -395,29 +1094,7 @@ int promiscuous_packet_search(char *stream, int search_length, uint32_t *lap, in
 		if (BARKER_DISTANCE[barker] <= MAX_BARKER_ERRORS) {
 			// Error correction
 			syncword = air_to_host64(symbols, 64);
-			
-			/* correct the barker code with a simple comparison */
-			corrected_barker = barker_correct[(uint8_t)(syncword >> 57)];
-			syncword = (syncword & 0x01ffffffffffffffULL) | corrected_barker;
-			
-			codeword = syncword ^ pn;
-
-			/* Zero syndrome -> good codeword. */
-			syndrome = gen_syndrome(codeword);
-			*ac_errors = 0;
-
-			/* Try to fix errors in bad codeword. */
-			if (syndrome) {
-				errors = find_syndrome(syndrome);
-				if (errors != NULL) {
-					syncword ^= errors->error;
-					*ac_errors = count_bits(errors->error);
-					syndrome = 0;
-				}
-				else {
-					*ac_errors = 0xff;  // fail
-				}
-			}
+			*ac_errors = correct_syncword(&syncword);
 			
 			if (*ac_errors <= max_ac_errors) {
 				*lap = (syncword >> 34) & 0xffffff;
@@ -429,10 +1106,16 @@ int promiscuous_packet_search(char *stream, int search_length, uint32_t *lap, in
 	return offset;
 }
 
-/* Matching a specific LAP */
-int find_known_lap(char *stream, int search_length, uint32_t lap, int max_ac_errors, uint8_t *ac_errors) {
-	uint64_t syncword, codeword, syndrome, corrected_barker, ac;
-	syndrome_struct *errors;
+static int lap_search = BTBB_LAP_SEARCH_SLIDING;
+
+void btbb_set_lap_search(int mode)
+{
+	lap_search = mode;
+}
+
+/* Matching a specific LAP, rebuilding the sync word at every offset */
+static int find_known_lap_naive(char *stream, int search_length, uint32_t lap, int max_ac_errors, uint8_t *ac_errors) {
+	uint64_t syncword, ac;
 	char *symbols;
 	int count, offset = -1;
 	
@@ -451,6 +1134,33 @@ int find_known_lap(char *stream, int search_length, uint32_t lap, int max_ac_err
 	return offset;
 }
 
+/* Matching a specific LAP, shifting one new symbol into the sync word
+ * at every offset */
+static int find_known_lap_sliding(char *stream, int search_length, uint32_t lap, int max_ac_errors, uint8_t *ac_errors) {
+	uint64_t syncword, ac;
+	int count;
+
+	ac = btbb_gen_syncword(lap);
+	syncword = air_to_host64(stream, 64);
+	for (count = 0; count < search_length; count++) {
+		if (count)
+			syncword = (syncword >> 1) | ((uint64_t)stream[count + 63] << 63);
+		*ac_errors = count_bits(syncword ^ ac);
+		if (*ac_errors <= max_ac_errors)
+			return count;
+	}
+	return -1;
+}
+
+/* Matching a specific LAP */
+int find_known_lap(char *stream, int search_length, uint32_t lap, int max_ac_errors, uint8_t *ac_errors) {
+	if (lap_search == BTBB_LAP_SEARCH_NAIVE)
+		return find_known_lap_naive(stream, search_length, lap,
+					    max_ac_errors, ac_errors);
+	return find_known_lap_sliding(stream, search_length, lap,
+				      max_ac_errors, ac_errors);
+}
+
 /* Looks for an AC in the stream */
 int btbb_find_ac(char *stream, int search_length, uint32_t lap, int max_ac_errors, btbb_packet **pkt_ptr) {
 	int offset;
@@ -473,21 +1183,257 @@ int btbb_find_ac(char *stream, int search_length, uint32_t lap, int max_ac_error
 	return offset;
 }
 
+/* Looks for an AC of any of several LAPs in the stream, in one pass.
+ * At the first offset where some LAP matches, the one with the fewest
+ * errors wins. */
+int btbb_find_ac_multi(char *stream, int search_length, const uint32_t *laps, int num_laps, int max_ac_errors, btbb_packet **pkt_ptr) {
+	uint64_t acs[BTBB_MAX_SEARCH_LAPS];
+	uint64_t syncword;
+	uint8_t errors, ac_errors;
+	int count, i, best;
+
+	if (num_laps < 1 || num_laps > BTBB_MAX_SEARCH_LAPS)
+		return -1;
+	for (i = 0; i < num_laps; i++)
+		acs[i] = btbb_gen_syncword(laps[i]);
+
+	syncword = air_to_host64(stream, 64);
+	for (count = 0; count < search_length; count++) {
+		if (count)
+			syncword = (syncword >> 1) | ((uint64_t)stream[count + 63] << 63);
+		best = -1;
+		ac_errors = 0xff;
+		for (i = 0; i < num_laps; i++) {
+			errors = count_bits(syncword ^ acs[i]);
+			if (errors < ac_errors) {
+				ac_errors = errors;
+				best = i;
+			}
+		}
+		if (ac_errors <= max_ac_errors) {
+			if (*pkt_ptr == NULL)
+				*pkt_ptr = btbb_packet_new();
+			init_packet(*pkt_ptr, laps[best], ac_errors);
+			return count;
+		}
+	}
+	return -1;
+}
+
 /* Copy data (symbols) into packet and set rx data. */
 void btbb_packet_set_data(btbb_packet *pkt, char *data, int length, uint8_t channel, uint32_t clkn)
 {
+	uint64_t word;
+	int i, j, n;
+
+	if (length > MAX_SYMBOLS)
+		length = MAX_SYMBOLS;
+	for (i = 0; i < length; i += n) {
+		n = MIN(length - i, 64);
+		word = 0;
+		for (j = 0; j < n; j++)
+			word |= (uint64_t) (data[i + j] & 1) << j;
+		pkt->symbols[i >> 6] = word;
+	}
+	symbols_done(pkt, length);
+
+	pkt->channel = channel;
+	pkt->clkn = clkn >> 1; // really CLK1
+}
+
+/* The 64 symbols of a packed stream starting at 'offset', in host order */
+static inline uint64_t packed_syncword(const uint64_t *stream, int offset)
+{
+	const uint64_t *word = &stream[offset >> 6];
+	int shift = offset & 63;
+
+	if (shift == 0)
+		return word[0];
+	return (word[0] >> shift) | (word[1] << (64 - shift));
+}
+
+/* Unpack the low 'n' bits of 'word' to dst, one per char */
+static inline void unpack_word(uint64_t word, char *dst, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8, word >>= 8)
+		memcpy(dst + i, BIT_SPREAD[word & 0xff], 8);
+	for (; i < n; i++, word >>= 1)
+		dst[i] = word & 1;
+}
+
+/* count trailing zero bits of a non-zero uint64_t */
+static inline int lowest_bit(uint64_t n)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(n);
+#else
 	int i;
+	for (i = 0; !(n & 1); i++)
+		n >>= 1;
+	return i;
+#endif
+}
+
+/* The two valid Barker codes (sync word bits 57-63), one the complement
+ * of the other */
+#define BARKER_CODE 0x27
+
+/* Bit-sliced Barker prefilter: bit t of the result is set if the Barker
+ * code of the sync word at offset 'base + t' is within one error of a
+ * valid one, same as the BARKER_DISTANCE test but for 64 offsets at a
+ * time. Reads the same words as packed_syncword(stream, base + 63). */
+static uint64_t barker_candidates(const uint64_t *stream, int base)
+{
+	uint64_t slice, one_a = 0, two_a = 0, one_b = 0, two_b = 0;
+	int j;
+
+	for (j = 0; j < 7; j++) {
+		/* lanes where bit j differs from the first code */
+		slice = packed_syncword(stream, base + 57 + j);
+		if ((BARKER_CODE >> j) & 1)
+			slice = ~slice;
+		two_a |= one_a & slice;
+		one_a |= slice;
+		/* and from the second */
+		slice = ~slice;
+		two_b |= one_b & slice;
+		one_b |= slice;
+	}
+	return ~two_a | ~two_b;
+}
+#if MAX_BARKER_ERRORS != 1
+#error "barker_candidates() only counts up to one Barker error"
+#endif
+
+static int promisc_search = BTBB_PROMISC_SEARCH_BITSLICED;
+
+void btbb_set_promisc_search(int mode)
+{
+	promisc_search = mode;
+}
+
+static int promiscuous_packet_search_packed(const uint64_t *stream, int search_length, uint32_t *lap, int max_ac_errors, uint8_t *ac_errors) {
+	uint64_t syncword, candidates;
+	uint64_t syncwords[64], syndromes_found[64];
+	int offsets[64];
+	int base, count, i, n;
+
+	if (promisc_search == BTBB_PROMISC_SEARCH_SCALAR) {
+		for (count = 0; count < search_length; count++) {
+			syncword = packed_syncword(stream, count);
+			if (BARKER_DISTANCE[syncword >> 57] > MAX_BARKER_ERRORS)
+				continue;
+			*ac_errors = correct_syncword(&syncword);
+			if (*ac_errors <= max_ac_errors) {
+				*lap = (syncword >> 34) & 0xffffff;
+				return count;
+			}
+		}
+		return -1;
+	}
+
+	for (base = 0; base < search_length; base += 64) {
+		candidates = barker_candidates(stream, base);
+		if (search_length - base < 64)
+			candidates &= (1ULL << (search_length - base)) - 1;
+		/* syndromes for all of this window's candidates at once */
+		for (n = 0; candidates; n++) {
+			offsets[n] = base + lowest_bit(candidates);
+			candidates &= candidates - 1;
+			syncwords[n] = packed_syncword(stream, offsets[n]);
+		}
+		barker_syndromes(syncwords, syndromes_found, n);
+		/* the earliest offset that corrects wins */
+		for (i = 0; i < n; i++) {
+			*ac_errors = correct_with_syndrome(&syncwords[i], syndromes_found[i]);
+			if (*ac_errors <= max_ac_errors) {
+				*lap = (syncwords[i] >> 34) & 0xffffff;
+				return offsets[i];
+			}
+		}
+	}
+	return -1;
+}
+
+static int find_known_lap_packed(const uint64_t *stream, int search_length, uint32_t lap, int max_ac_errors, uint8_t *ac_errors) {
+	uint64_t ac = btbb_gen_syncword(lap);
+	int count;
+
+	for (count = 0; count < search_length; count++) {
+		*ac_errors = count_bits(packed_syncword(stream, count) ^ ac);
+		if (*ac_errors <= max_ac_errors)
+			return count;
+	}
+	return -1;
+}
+
+/* Looks for an AC in a packed stream */
+int btbb_find_ac_packed(const uint64_t *stream, int search_length, uint32_t lap, int max_ac_errors, btbb_packet **pkt_ptr) {
+	int offset;
+	uint8_t ac_errors;
+
+	if (lap == LAP_ANY)
+		offset = promiscuous_packet_search_packed(stream, search_length,
+							  &lap, max_ac_errors, &ac_errors);
+	else
+		offset = find_known_lap_packed(stream, search_length, lap,
+					       max_ac_errors, &ac_errors);
+
+	if (offset >= 0) {
+		if (*pkt_ptr == NULL)
+			*pkt_ptr = btbb_packet_new();
+		init_packet(*pkt_ptr, lap, ac_errors);
+	}
+
+	return offset;
+}
+
+/* Copy symbols from a packed stream into packet and set rx data. Only
+ * the words holding the 'length' symbols from 'offset' are read. */
+void btbb_packet_set_data_packed(btbb_packet *pkt, const uint64_t *data, int offset, int length, uint8_t channel, uint32_t clkn)
+{
+	const uint64_t *word;
+	int i, shift, last;
 
 	if (length > MAX_SYMBOLS)
 		length = MAX_SYMBOLS;
-	for (i = 0; i < length; i++)
-		pkt->symbols[i] = data[i]; 
+	last = (offset + length - 1) >> 6;
+	for (i = 0; i < length; i += 64, offset += 64) {
+		word = &data[offset >> 6];
+		shift = offset & 63;
+		if (shift == 0)
+			pkt->symbols[i >> 6] = word[0];
+		else if ((offset >> 6) < last)
+			pkt->symbols[i >> 6] = (word[0] >> shift) | (word[1] << (64 - shift));
+		else
+			pkt->symbols[i >> 6] = word[0] >> shift;
+	}
+	symbols_done(pkt, length);
 
-	pkt->length = length;
 	pkt->channel = channel;
 	pkt->clkn = clkn >> 1; // really CLK1
 }
 
+/* Unpack 'count' symbols from 'start', one per char. Symbols past the
+ * end of the packet read as zero. */
+static void get_symbols(const btbb_packet *pkt, int start, int count, char *dst)
+{
+	uint64_t word;
+	int i, n, end;
+
+	end = MIN(start + count, pkt->length);
+	for (i = start; i < end; i += n, dst += n) {
+		/* the pad word makes the second word there to read */
+		word = packed_syncword(pkt->symbols, i);
+		n = MIN(end - i, 64);
+		unpack_word(word, dst, n);
+	}
+	if (count > MAX(end - start, 0))
+		memset(dst, 0, count - MAX(end - start, 0));
+}
+
 void btbb_packet_set_flag(btbb_packet *pkt, int flag, int val)
 {
 	uint32_t mask = 1L << flag;
@@ -502,9 +1448,50 @@ int btbb_packet_get_flag(const btbb_packet *pkt, int flag)
 	return ((pkt->flags & mask) != 0);
 }
 
+/* btbb_get_symbols() and btbb_get_payload() unpack into a buffer
+ * belonging to the calling thread */
+typedef struct {
+	char symbols[MAX_SYMBOLS];
+	char payload[MAX_PAYLOAD_LENGTH];
+} unpacked_buffer;
+
+static pthread_key_t unpacked_key;
+static pthread_once_t unpacked_once = PTHREAD_ONCE_INIT;
+static int unpacked_ok;
+
+static void unpacked_init(void)
+{
+	unpacked_ok = (pthread_key_create(&unpacked_key, free) == 0);
+}
+
+static unpacked_buffer *thread_unpacked(void)
+{
+	unpacked_buffer *buf;
+
+	pthread_once(&unpacked_once, unpacked_init);
+	if (!unpacked_ok)
+		return NULL;
+	buf = (unpacked_buffer *) pthread_getspecific(unpacked_key);
+	if (!buf) {
+		buf = (unpacked_buffer *) malloc(sizeof(unpacked_buffer));
+		if (buf && pthread_setspecific(unpacked_key, buf)) {
+			free(buf);
+			buf = NULL;
+		}
+		if (!buf)
+			fprintf(stderr, "%s: unable to allocate buffer\n", __FUNCTION__);
+	}
+	return buf;
+}
+
 const char *btbb_get_symbols(const btbb_packet* pkt)
 {
-	return (const char*) pkt->symbols;
+	unpacked_buffer *buf = thread_unpacked();
+
+	if (!buf)
+		return NULL;
+	get_symbols(pkt, 0, MAX_SYMBOLS, buf->symbols);
+	return buf->symbols;
 }
 
 int btbb_packet_get_payload_length(const btbb_packet* pkt)
@@ -514,14 +1501,22 @@ int btbb_packet_get_payload_length(const btbb_packet* pkt)
 
 const char *btbb_get_payload(const btbb_packet* pkt)
 {
-	return (const char*) pkt->payload;
+	unpacked_buffer *buf = thread_unpacked();
+	int i, n, bits;
+
+	if (!buf)
+		return NULL;
+	bits = MIN(pkt->payload_length * 8, MAX_PAYLOAD_LENGTH);
+	for (i = 0; i < bits; i += n) {
+		n = MIN(bits - i, 8);
+		unpack_word(pkt->payload[i >> 3], buf->payload + i, n);
+	}
+	return buf->payload;
 }
 
 int btbb_get_payload_packed(const btbb_packet* pkt, char *dst)
 {
-	int i;
-	for(i=0;i<pkt->payload_length;i++)
-		dst[i] = (char) air_to_host8(&pkt->payload[i*8], 8);
+	memcpy(dst, pkt->payload, pkt->payload_length);
 	return pkt->payload_length;
 }
 
@@ -573,135 +1568,222 @@ static uint8_t reverse(char byte)
 }
 
 
-/* Decode 1/3 rate FEC, three like symbols in a row */
+/* Decode 1/3 rate FEC, three like symbols in a row. Up to 64 output
+ * bits at a time are voted on as packed words. */
 static int unfec13(char *input, char *output, int length)
 {
-	int a, b, c, i;
+	uint64_t a, b, c, majority;
+	int i, n, done;
 	int be = 0; /* bit errors */
 
-	for (i = 0; i < length; i++) {
-		a = 3 * i;
-		b = a + 1;
-		c = a + 2;
-		output[i] = ((input[a] & input[b]) | (input[b] & input[c]) |
-				(input[c] & input[a]));
-		be += ((input[a] ^ input[b]) | (input[b] ^ input[c]) |
-				(input[c] ^ input[a]));
+	for (done = 0; done < length; done += n) {
+		n = MIN(length - done, 64);
+		a = b = c = 0;
+		for (i = 0; i < n; i++, input += 3) {
+			a |= (uint64_t) input[0] << i;
+			b |= (uint64_t) input[1] << i;
+			c |= (uint64_t) input[2] << i;
+		}
+		majority = (a & b) | (b & c) | (c & a);
+		be += count_bits((a ^ b) | (b ^ c));
+		for (i = 0; i < n; i++)
+			output[done + i] = (majority >> i) & 1;
 	}
 
 	return (be < (length / 4));
 }
 
-/* encode 10 bits with 2/3 rate FEC code, a (15,10) shortened Hamming code */
-static uint16_t fec23(uint16_t data)
+/* Parity bits of the (15,10) shortened Hamming code for the low and
+ * high 5 data bits, host order. Generator rows for data bits 0-9:
+ * 0x2c01, 0x5802, 0x1c04, 0x3808, 0x7010,
+ * 0x4c20, 0x3440, 0x6880, 0x7d00, 0x5600 */
+static const uint8_t fec23_parity_lo[32] = {
+	0x00, 0x0b, 0x16, 0x1d, 0x07, 0x0c, 0x11, 0x1a, 0x0e, 0x05, 0x18, 0x13, 0x09, 0x02, 0x1f, 0x14,
+	0x1c, 0x17, 0x0a, 0x01, 0x1b, 0x10, 0x0d, 0x06, 0x12, 0x19, 0x04, 0x0f, 0x15, 0x1e, 0x03, 0x08};
+static const uint8_t fec23_parity_hi[32] = {
+	0x00, 0x13, 0x0d, 0x1e, 0x1a, 0x09, 0x17, 0x04, 0x1f, 0x0c, 0x12, 0x01, 0x05, 0x16, 0x08, 0x1b,
+	0x15, 0x06, 0x18, 0x0b, 0x0f, 0x1c, 0x02, 0x11, 0x0a, 0x19, 0x07, 0x14, 0x10, 0x03, 0x1d, 0x0e};
+
+/* Data bits to flip for each syndrome: none for no error or an error in
+ * a parity bit, 0xffff if the block is uncorrectable */
+static const uint16_t fec23_correction[32] = {
+	0x0000, 0x0000, 0x0000, 0xffff, 0x0000, 0xffff, 0xffff, 0x0004,
+	0x0000, 0xffff, 0xffff, 0x0001, 0xffff, 0x0040, 0x0008, 0xffff,
+	0x0000, 0xffff, 0xffff, 0x0020, 0xffff, 0x0200, 0x0002, 0xffff,
+	0xffff, 0xffff, 0x0080, 0xffff, 0x0010, 0xffff, 0xffff, 0x0100};
+
+/* Decode 2/3 rate FEC, a (15,10) shortened Hamming code. 'length' is
+ * the number of bits before encoding; output must have room for it
+ * rounded up to a multiple of 10. Returns 0 if a block has more than
+ * one bit error. */
+static int unfec23(char *input, char *output, int length)
 {
-	int i;
-	uint16_t codeword = 0;
+	int optr, count;
+	uint16_t data, correction;
+	uint8_t check;
 
-	/* host order, not air order */
-	for (i = 0; i < 10; i++)
-		if (data & (1 << i))
-			codeword ^= fec23_gen_matrix[i];
+	for (optr = 0; optr < length; input += 15, optr += 10) {
+		// grab data and error check in host format
+		data = air_to_host16(input, 10);
+		check = air_to_host8(input + 10, 5);
 
-	return codeword;
+		correction = fec23_correction[check ^ fec23_parity_lo[data & 0x1f]
+					      ^ fec23_parity_hi[data >> 5]];
+		if (correction == 0xffff)
+			return 0;
+		data ^= correction;
+
+		for (count = 0; count < 10; count++)
+			output[optr + count] = (data >> count) & 1;
+	}
+	return 1;
 }
 
-/* Decode 2/3 rate FEC, a (15,10) shortened Hamming code */
-static char *unfec23(char *input, int length)
+/* 64 bits of the keystream for 'clock', from position 'pos' (< 127) */
+static inline uint64_t whitening_word(int clock, int pos)
 {
-	/* input points to the input data
-	 * length is length in bits of the data
-	 * before it was encoded with fec2/3 */
-	int iptr, optr, count;
-	char* output;
-	uint8_t diff, check;
-	uint16_t data, codeword;
+	const uint64_t *key = WHITENING_KEYSTREAM[clock & 0x3f];
+	int shift = pos & 63;
 
-	diff = length % 10;
-	// padding at end of data
-	if(0!=diff)
-		length += (10 - diff);
+	if (shift == 0)
+		return key[pos >> 6];
+	return (key[pos >> 6] >> shift) | (key[(pos >> 6) + 1] << (64 - shift));
+}
 
-	output = (char *) malloc(length);
+/* Remove the whitening from an air order array, eight symbols at a
+ * time with the precomputed keystream */
+static void unwhiten(char* input, char* output, int clock, int length, int skip, btbb_packet* pkt)
+{
+	uint64_t key, in, spread;
+	int count, n, i, pos;
 
-	for (iptr = 0, optr = 0; optr<length; iptr += 15, optr += 10) {
-		// copy data to output
-		for(count=0;count<10;count++)
-			output[optr+count] = input[iptr+count];
+	/* not whitened: just copy input to output */
+	if (!btbb_packet_get_flag(pkt, BTBB_WHITENED)) {
+		memmove(output, input, length);
+		return;
+	}
 
-		// grab data and error check in host format
-		data = air_to_host16(input+iptr, 10);
-		check = air_to_host8(input+iptr+10, 5);
-
-		// call fec23 on data to generate the codeword
-		codeword = fec23(data);
-		diff = check ^ (codeword >> 10);
-
-		/* no errors or single bit errors (errors in the parity bit):
-		 * (a strong hint it's a real packet)
-		 * Otherwise we need to corret the output*/
-		if (diff & (diff - 1)) {
-			switch (diff) {
-			/* comments are the bit that's wrong and the value
-			* of diff in air order, from the BT spec */
-				// 1000000000 11010
-				case 0x0b: output[optr] ^= 1; break;
-				// 0100000000 01101
-				case 0x16: output[optr+1] ^= 1; break;
-				// 0010000000 11100
-				case 0x07: output[optr+2] ^= 1; break;
-				// 0001000000 01110
-				case 0x0e: output[optr+3] ^= 1; break;
-				// 0000100000 00111
-				case 0x1c: output[optr+4] ^= 1; break;
-				// 0000010000 11001
-				case 0x13: output[optr+5] ^= 1; break;
-				// 0000001000 10110
-				case 0x0d: output[optr+6] ^= 1; break;
-				// 0000000100 01011
-				case 0x1a: output[optr+7] ^= 1; break;
-				// 0000000010 11111
-				case 0x1f: output[optr+8] ^= 1; break;
-				// 0000000001 10101
-				case 0x15: output[optr+9] ^= 1; break;
-				/* not one of these errors, probably multiple bit errors
-				* or maybe not a real packet, safe to drop it? */
-				default: free(output); return 0;
-			}
+	pos = skip % 127;
+	for (count = 0; count < length; count += n) {
+		n = MIN(length - count, 64);
+		key = whitening_word(clock, pos);
+		for (i = 0; i + 8 <= n; i += 8, key >>= 8) {
+			memcpy(&in, input + count + i, 8);
+			memcpy(&spread, BIT_SPREAD[key & 0xff], 8);
+			in ^= spread;
+			memcpy(output + count + i, &in, 8);
 		}
+		for (; i < n; i++, key >>= 1)
+			output[count + i] = input[count + i] ^ (key & 1);
+		pos = (pos + n) % 127;
 	}
-	return output;
 }
 
+/* Store the low 'n' bits of 'bits' at bit 'offset' of the payload */
+static void put_payload_bits(btbb_packet* pkt, int offset, uint64_t bits, int n)
+{
+	uint8_t *byte, mask;
+	int shift, m;
+
+	for (; n > 0; n -= m, offset += m, bits >>= m) {
+		byte = &pkt->payload[offset >> 3];
+		shift = offset & 7;
+		m = MIN(8 - shift, n);
+		mask = ((1 << m) - 1) << shift;
+		*byte = (*byte & ~mask) | ((bits << shift) & mask);
+	}
+}
 
-/* Remove the whitening from an air order array */
-static void unwhiten(char* input, char* output, int clock, int length, int skip, btbb_packet* pkt)
+/* 'bits' bits of the payload from 'offset', at most 32 */
+static uint32_t payload_field(const btbb_packet* pkt, int offset, int bits)
 {
-	int count, index;
-	index = INDICES[clock & 0x3f];
-	index += skip;
-	index %= 127;
+	uint32_t field = 0;
+	int i;
 
-	for(count = 0; count < length; count++)
-	{
-		/* unwhiten if whitened, otherwise just copy input to output */
-		output[count] = btbb_packet_get_flag(pkt, BTBB_WHITENED) ?
-			input[count] ^ WHITENING_DATA[index] : input[count];
-		index += 1;
-		index %= 127;
+	for (i = 0; i < bits; i++, offset++)
+		field |= (uint32_t) ((pkt->payload[offset >> 3] >> (offset & 7)) & 1) << i;
+	return field;
+}
+
+/* Unwhiten 'length' air order bits to 'offset' in the packed payload,
+ * 64 at a time, and keep track of how far the payload has been written */
+static void unwhiten_payload(char* input, int clock, int offset, int length, btbb_packet* pkt)
+{
+	int whitened = btbb_packet_get_flag(pkt, BTBB_WHITENED);
+	int pos = (18 + offset) % 127;
+	uint64_t bits;
+	int count, n, i;
+
+	for (count = 0; count < length; count += n) {
+		n = MIN(length - count, 64);
+		bits = 0;
+		for (i = 0; i < n; i++)
+			bits |= (uint64_t) (input[count + i] & 1) << i;
+		if (whitened)
+			bits ^= whitening_word(clock, pos);
+		put_payload_bits(pkt, offset + count, bits, n);
+		pos = (pos + n) % 127;
+	}
+	if (offset + length > pkt->payload_bits)
+		pkt->payload_bits = offset + length;
+}
+
+/* A decoder can leave payload_length past the bits it wrote (when the
+ * packet is too short, say). Zero that gap, so that readers bounded by
+ * payload_length never see what a reused packet held before. */
+static void payload_done(btbb_packet* pkt)
+{
+	int bits = MIN(pkt->payload_length * 8, MAX_PAYLOAD_LENGTH);
+	int n;
+
+	for (; pkt->payload_bits < bits; pkt->payload_bits += n) {
+		n = MIN(bits - pkt->payload_bits, 64);
+		put_payload_bits(pkt, pkt->payload_bits, 0, n);
 	}
 }
 
-/* Pointer to start of packet, length of packet in bits, UAP */
-static uint16_t crcgen(char *payload, int length, int UAP)
+/* Decode the FEC 1/3 packet header once and unwhiten it under all 64
+ * CLK1-6 values: headers[c] holds the 18 header bits for clock c, in
+ * air order from the LSB. Returns 0 if the header FEC fails. */
+int unwhiten_headers(btbb_packet* pkt, uint32_t *headers)
+{
+	char stream[54];
+	char header[18];
+	uint32_t packed;
+	int clock;
+
+	/* skip 72 bit access code */
+	get_symbols(pkt, 68, 54, stream);
+	if (!unfec13(stream, header, 18))
+		return 0;
+	packed = air_to_host32(header, 18);
+	if (!btbb_packet_get_flag(pkt, BTBB_WHITENED)) {
+		for (clock = 0; clock < 64; clock++)
+			headers[clock] = packed;
+		return 1;
+	}
+	for (clock = 0; clock < 64; clock++)
+		headers[clock] = packed ^ (WHITENING_KEYSTREAM[clock][0] & 0x3ffff);
+	return 1;
+}
+
+/* Pointer to start of packed packet, length of packet in bits, UAP */
+static uint16_t crcgen(const uint8_t *payload, int length, int UAP)
 {
 	char bit;
-	uint16_t reg, count;
+	uint16_t reg;
+	int count;
 
 	reg = (reverse(UAP) << 8) & 0xff00;
-	for(count = 0; count < length; count++)
+
+	/* whole bytes through the table */
+	for (count = 0; count + 8 <= length; count += 8)
+		reg = (reg >> 8) ^ CRC16_TABLE[(reg ^ payload[count >> 3]) & 0xff];
+
+	/* remaining bits one at a time */
+	for (; count < length; count++)
 	{
-		bit = payload[count];
+		bit = payload[count >> 3] >> (count & 7);
 
 		reg = (reg >> 1) | (((reg & 0x0001) ^ (bit & 0x01))<<15);
 
@@ -717,16 +1799,7 @@ static uint16_t crcgen(char *payload, int length, int UAP)
 /* extract UAP by reversing the HEC computation */
 static uint8_t uap_from_hec(uint16_t data, uint8_t hec)
 {
-        int i;
-
-        for (i = 9; i >= 0; i--) {
-                /* 0x65 is xor'd if MSB is 1, else 0x00 (which does nothing) */
-                if (hec & 0x80)
-                        hec ^= 0x65;
-
-                hec = (hec << 1) | (((hec >> 7) ^ (data >> i)) & 0x01);
-        }
-        return reverse(hec);
+	return UAP_FROM_DATA[data & 0x3ff] ^ UAP_FROM_HEC[hec];
 }
 
 /* check if the packet's CRC is correct for a given clock (CLK1-6) */
@@ -777,6 +1850,7 @@ int crc_check(int clock, btbb_packet* pkt)
 		default:
 			break;
 	}
+	payload_done(pkt);
 	/*
 	 * never return a zero result unless this is a FHS, DM1, or HV1.  any
 	 * other type could have actually been something else (another logical
@@ -800,15 +1874,15 @@ static int payload_crc(btbb_packet* pkt)
 	uint16_t check; /* CRC supplied by packet */
 
 	crc = crcgen(pkt->payload, (pkt->payload_length - 2) * 8, pkt->UAP);
-	check = air_to_host16(&pkt->payload[(pkt->payload_length - 2) * 8], 16);
+	check = pkt->payload[pkt->payload_length - 2] |
+		(pkt->payload[pkt->payload_length - 1] << 8);
 
 	return (crc == check);
 }
 
 int fhs(int clock, btbb_packet* pkt)
 {
-	/* skip the access code and packet header */
-	char *stream = pkt->symbols + 122;
+	char stream[240];
 	/* number of symbols remaining after access code and packet header */
 	int size = pkt->length - 122;
 
@@ -817,28 +1891,25 @@ int fhs(int clock, btbb_packet* pkt)
 	if (size < pkt->payload_length * 12)
 		return 1; //FIXME should throw exception
 
-	char *corrected = unfec23(stream, pkt->payload_length * 8);
-	if (!corrected)
+	/* skip the access code and packet header */
+	get_symbols(pkt, 122, pkt->payload_length * 12, stream);
+	char corrected[FEC23_MAX_BITS];
+	if (!unfec23(stream, corrected, pkt->payload_length * 8))
 		return 0;
 
 	/* try to unwhiten with known clock bits */
-	unwhiten(corrected, pkt->payload, clock, pkt->payload_length * 8, 18, pkt);
-	if (payload_crc(pkt)) {
-		free(corrected);
+	unwhiten_payload(corrected, clock, 0, pkt->payload_length * 8, pkt);
+	if (payload_crc(pkt))
 		return 1000;
-	}
 
 	/* try all 32 possible X-input values instead */
 	for (clock = 32; clock < 64; clock++) {
-		unwhiten(corrected, pkt->payload, clock, pkt->payload_length * 8, 18, pkt);
-		if (payload_crc(pkt)) {
-			free(corrected);
+		unwhiten_payload(corrected, clock, 0, pkt->payload_length * 8, pkt);
+		if (payload_crc(pkt))
 			return 1000;
-		}
 	}
 
 	/* failed to unwhiten */
-	free(corrected);
 	return 0;
 }
 
@@ -852,11 +1923,10 @@ static int decode_payload_header(char *stream, int clock, int header_bytes, int
 		if(fec) {
 			if(size < 30)
 				return 0; //FIXME should throw exception
-			char *corrected = unfec23(stream, 16);
-			if (!corrected)
+			char corrected[20];
+			if (!unfec23(stream, corrected, 16))
 				return 0;
 			unwhiten(corrected, pkt->payload_header, clock, 16, 18, pkt);
-			free(corrected);
 		} else {
 			unwhiten(stream, pkt->payload_header, clock, 16, 18, pkt);
 		}
@@ -868,11 +1938,10 @@ static int decode_payload_header(char *stream, int clock, int header_bytes, int
 		if(fec) {
 			if(size < 15)
 				return 0; //FIXME should throw exception
-			char *corrected = unfec23(stream, 8);
-			if (!corrected)
+			char corrected[10];
+			if (!unfec23(stream, corrected, 8))
 				return 0;
 			unwhiten(corrected, pkt->payload_header, clock, 8, 18, pkt);
-			free(corrected);
 		} else {
 			unwhiten(stream, pkt->payload_header, clock, 8, 18, pkt);
 		}
@@ -927,8 +1996,9 @@ int DM(int clock, btbb_packet* pkt)
 	int header_bytes = 2;
 	/* maximum payload length */
 	int max_length;
+	char stream[FEC23_SYMBOLS(MAX_PAYLOAD_LENGTH)];
 	/* skip the access code and packet header */
-	char *stream = pkt->symbols + 122;
+	int start = 122;
 	/* number of symbols remaining after access code and packet header */
 	int size = pkt->length - 122;
 
@@ -936,7 +2006,7 @@ int DM(int clock, btbb_packet* pkt)
 	{
 		case PACKET_TYPE_DV:
 			/* skip 80 voice bits, then treat the rest like a DM1 */
-			stream += 80;
+			start += 80;
 			size -= 80;
 			header_bytes = 1;
 			/* I don't think the length of the voice field ("synchronous data
@@ -959,6 +2029,7 @@ int DM(int clock, btbb_packet* pkt)
 		default: /* not a DM1/3/5 or DV */
 			return 0;
 	}
+	get_symbols(pkt, start, FEC23_SYMBOLS(header_bytes * 8), stream);
 	if(!decode_payload_header(stream, clock, header_bytes, size, 1, pkt))
 		return 0;
 	/* check that the length indicated in the payload header is within spec */
@@ -969,11 +2040,11 @@ int DM(int clock, btbb_packet* pkt)
 	if(bitlength > size)
 		return 1; //FIXME should throw exception
 
-	char *corrected = unfec23(stream, bitlength);
-	if (!corrected)
+	get_symbols(pkt, start, FEC23_SYMBOLS(bitlength), stream);
+	char corrected[FEC23_MAX_BITS];
+	if (!unfec23(stream, corrected, bitlength))
 		return 0;
-	unwhiten(corrected, pkt->payload, clock, bitlength, 18, pkt);
-	free(corrected);
+	unwhiten_payload(corrected, clock, 0, bitlength, pkt);
 
 	if (payload_crc(pkt))
 		return 10;
@@ -991,8 +2062,7 @@ int DH(int clock, btbb_packet* pkt)
 	int header_bytes = 2;
 	/* maximum payload length */
 	int max_length;
-	/* skip the access code and packet header */
-	char *stream = pkt->symbols + 122;
+	char stream[MAX_PAYLOAD_LENGTH];
 	/* number of symbols remaining after access code and packet header */
 	int size = pkt->length - 122;
 	
@@ -1012,6 +2082,8 @@ int DH(int clock, btbb_packet* pkt)
 		default: /* not a DH1/3/5 */
 			return 0;
 	}
+	/* skip the access code and packet header */
+	get_symbols(pkt, 122, header_bytes * 8, stream);
 	if(!decode_payload_header(stream, clock, header_bytes, size, 0, pkt))
 		return 0;
 	/* check that the length indicated in the payload header is within spec */
@@ -1022,7 +2094,8 @@ int DH(int clock, btbb_packet* pkt)
 	if(bitlength > size)
 		return 1; //FIXME should throw exception
 
-	unwhiten(stream, pkt->payload, clock, bitlength, 18, pkt);
+	get_symbols(pkt, 122, bitlength, stream);
+	unwhiten_payload(stream, clock, 0, bitlength, pkt);
 	
 	/* AUX1 has no CRC */
 	if (pkt->packet_type == 9)
@@ -1037,8 +2110,9 @@ int DH(int clock, btbb_packet* pkt)
 
 int EV3(int clock, btbb_packet* pkt)
 {
-	/* skip the access code and packet header */
-	char *stream = pkt->symbols + 122;
+	/* every byte is unwhitened from the first 8 symbols after the
+	 * access code and packet header */
+	char stream[8];
 
 	/* number of symbols remaining after access code and packet header */
 	int size = pkt->length - 122;
@@ -1049,6 +2123,7 @@ int EV3(int clock, btbb_packet* pkt)
 	/* number of bits we have decoded */
 	int bits;
 
+	get_symbols(pkt, 122, 8, stream);
 	/* check CRC for any integer byte length up to maxlength */
 	for (pkt->payload_length = 0;
 			pkt->payload_length < maxlength; pkt->payload_length++) {
@@ -1058,7 +2133,7 @@ int EV3(int clock, btbb_packet* pkt)
 		/* unwhiten next byte */
 		if ((bits + 8) > size)
 			return 1; //FIXME should throw exception
-		unwhiten(stream, pkt->payload + bits, clock, 8, 18 + bits, pkt);
+		unwhiten_payload(stream, clock, bits, 8, pkt);
 
 		if ((pkt->payload_length > 2) && (payload_crc(pkt)))
 				return 10;
@@ -1068,10 +2143,8 @@ int EV3(int clock, btbb_packet* pkt)
 
 int EV4(int clock, btbb_packet* pkt)
 {
-	char *corrected;
-
-	/* skip the access code and packet header */
-	char *stream = pkt->symbols + 122;
+	char corrected[10];
+	char stream[1470];
 
 	/* number of symbols remaining after access code and packet header */
 	int size = pkt->length - 122;
@@ -1093,25 +2166,24 @@ int EV4(int clock, btbb_packet* pkt)
 
 	pkt->payload_length = 1;
 
+	/* skip the access code and packet header */
+	get_symbols(pkt, 122, MIN(size, maxlength), stream);
 	while (syms < maxlength) {
 
 		/* unfec/unwhiten next block (15 symbols -> 10 bits) */
 		if (syms + 15 > size)
 			return 1; //FIXME should throw exception
-		corrected = unfec23(stream + syms, 10);
-		if (!corrected) {
-			free(corrected);
+		if (!unfec23(stream + syms, corrected, 10)) {
 			if (syms < minlength)
 				return 0;
 			else
 				return 1;
 		}
-		unwhiten(corrected, pkt->payload + bits, clock, 10, 18 + bits, pkt);
-		free(corrected);
+		unwhiten_payload(corrected, clock, bits, 10, pkt);
 
-		/* check CRC one byte at a time */
+		/* check CRC one byte at a time, once there is room for one */
 		while (pkt->payload_length * 8 <= bits) {
-			if (payload_crc(pkt))
+			if ((pkt->payload_length > 2) && (payload_crc(pkt)))
 				return 10;
 			pkt->payload_length++;
 		}
@@ -1123,8 +2195,9 @@ int EV4(int clock, btbb_packet* pkt)
 
 int EV5(int clock, btbb_packet* pkt)
 {
-	/* skip the access code and packet header */
-	char *stream = pkt->symbols + 122;
+	/* every byte is unwhitened from the first 8 symbols after the
+	 * access code and packet header */
+	char stream[8];
 
 	/* number of symbols remaining after access code and packet header */
 	int size = pkt->length - 122;
@@ -1135,6 +2208,7 @@ int EV5(int clock, btbb_packet* pkt)
 	/* number of bits we have decoded */
 	int bits;
 
+	get_symbols(pkt, 122, 8, stream);
 	/* check CRC for any integer byte length up to maxlength */
 	for (pkt->payload_length = 0;
 			pkt->payload_length < maxlength; pkt->payload_length++) {
@@ -1144,7 +2218,7 @@ int EV5(int clock, btbb_packet* pkt)
 		/* unwhiten next byte */
 		if ((bits + 8) > size)
 			return 1; //FIXME should throw exception
-		unwhiten(stream, pkt->payload + bits, clock, 8, 18 + bits, pkt);
+		unwhiten_payload(stream, clock, bits, 8, pkt);
 
 		if ((pkt->payload_length > 2) && (payload_crc(pkt)))
 				return 10;
@@ -1155,8 +2229,7 @@ int EV5(int clock, btbb_packet* pkt)
 /* HV packet type payload parser */
 int HV(int clock, btbb_packet* pkt)
 {
-	/* skip the access code and packet header */
-	char *stream = pkt->symbols + 122;
+	char stream[240];
 	/* number of symbols remaining after access code and packet header */
 	int size = pkt->length - 122;
 
@@ -1165,6 +2238,8 @@ int HV(int clock, btbb_packet* pkt)
 		pkt->payload_length = 0;
 		return 1; //FIXME should throw exception
 	}
+	/* skip the access code and packet header */
+	get_symbols(pkt, 122, 240, stream);
 
 	switch (pkt->packet_type) {
 		case PACKET_TYPE_HV1:
@@ -1174,24 +2249,23 @@ int HV(int clock, btbb_packet* pkt)
 				return 0;
 			pkt->payload_length = 10;
 			btbb_packet_set_flag(pkt, BTBB_HAS_PAYLOAD, 1);
-			unwhiten(corrected, pkt->payload, clock, pkt->payload_length*8, 18, pkt);
+			unwhiten_payload(corrected, clock, 0, pkt->payload_length*8, pkt);
 			}
 			break;
 		case PACKET_TYPE_HV2:
 			{
-			char *corrected = unfec23(stream, 160);
-			if (!corrected)
+			char corrected[160];
+			if (!unfec23(stream, corrected, 160))
 				return 0;
 			pkt->payload_length = 20;
 			btbb_packet_set_flag(pkt, BTBB_HAS_PAYLOAD, 1);
-			unwhiten(corrected, pkt->payload, clock, pkt->payload_length*8, 18, pkt);
-			free(corrected);
+			unwhiten_payload(corrected, clock, 0, pkt->payload_length*8, pkt);
 			}
 			break;
 		case PACKET_TYPE_HV3:
 			pkt->payload_length = 30;
 			btbb_packet_set_flag(pkt, BTBB_HAS_PAYLOAD, 1);
-			unwhiten(stream, pkt->payload, clock, pkt->payload_length*8, 18, pkt);
+			unwhiten_payload(stream, clock, 0, pkt->payload_length*8, pkt);
 			break;
 	}
 
@@ -1202,12 +2276,13 @@ int HV(int clock, btbb_packet* pkt)
  */
 uint8_t try_clock(int clock, btbb_packet* pkt)
 {
-	/* skip 72 bit access code */
-	char *stream = pkt->symbols + 68;
+	char stream[54];
 	/* 18 bit packet header */
 	char header[18];
 	char unwhitened[18];
 
+	/* skip 72 bit access code */
+	get_symbols(pkt, 68, 54, stream);
 	if (!unfec13(stream, header, 18))
 		return 0;
 	unwhiten(header, unwhitened, clock, 18, 0, pkt);
@@ -1219,16 +2294,36 @@ uint8_t try_clock(int clock, btbb_packet* pkt)
 	return pkt->UAP;
 }
 
+/* try all 64 clock values (CLK1-6) on the packet header at once:
+ * uaps[c] and types[c] receive the UAP and packet type try_clock(c)
+ * would set. Returns 0 if the header FEC fails. */
+int try_clocks(btbb_packet* pkt, uint8_t *uaps, uint8_t *types)
+{
+	uint32_t headers[64];
+	int clock;
+
+	if (!unwhiten_headers(pkt, headers))
+		return 0;
+	for (clock = 0; clock < 64; clock++) {
+		uaps[clock] = uap_from_hec(headers[clock] & 0x3ff, headers[clock] >> 10);
+		types[clock] = (headers[clock] >> 3) & 0xf;
+	}
+	return 1;
+}
+
 /* decode the packet header */
 int btbb_decode_header(btbb_packet* pkt)
 {
-	/* skip 72 bit access code */
-	char *stream = pkt->symbols + 68;
+	char stream[54];
 	/* 18 bit packet header */
 	char header[18];
 	uint8_t UAP;
 
-	if (btbb_packet_get_flag(pkt, BTBB_CLK6_VALID) && unfec13(stream, header, 18)) {
+	if (!btbb_packet_get_flag(pkt, BTBB_CLK6_VALID))
+		return 0;
+	/* skip 72 bit access code */
+	get_symbols(pkt, 68, 54, stream);
+	if (unfec13(stream, header, 18)) {
 		unwhiten(header, pkt->packet_header, pkt->clock, 18, 0, pkt);
 		uint16_t hdr_data = air_to_host16(pkt->packet_header, 10);
 		uint8_t hec = air_to_host8(&pkt->packet_header[10], 8);
@@ -1316,6 +2411,7 @@ int btbb_decode_payload(btbb_packet* pkt)
 			rv = DH(pkt->clock, pkt);
 			break;
 	}
+	payload_done(pkt);
 	btbb_packet_set_flag(pkt, BTBB_HAS_PAYLOAD, 1);
 	return rv;
 }
@@ -1335,7 +2431,7 @@ void btbb_print_packet(const btbb_packet* pkt)
 			printf("  Data: ");
 			int i;
 			for(i=0; i<pkt->payload_length; i++)
-				printf(" %02x", air_to_host8(pkt->payload + 8*i, 8));
+				printf(" %02x", pkt->payload[i]);
 			printf("\n");
 		}
 	}
@@ -1366,7 +2462,7 @@ char *tun_format(btbb_packet* pkt)
 	tun_format[8] = (char) air_to_host8(&pkt->packet_header[10], 8);
 
 	for(i=0;i<pkt->payload_length;i++)
-		tun_format[i+9] = (char) air_to_host8(&pkt->payload[i*8], 8);
+		tun_format[i+9] = (char) pkt->payload[i];
 
 	return tun_format;
 }
@@ -1374,8 +2470,8 @@ char *tun_format(btbb_packet* pkt)
 /* check to see if the packet has a header */
 int btbb_header_present(const btbb_packet* pkt)
 {
-	/* skip to last bit of sync word */
-	const char *stream = pkt->symbols + 63;
+	char symbols[59];
+	const char *stream = symbols;
 	int be = 0; /* bit errors */
 	char msb;   /* most significant (last) bit of sync word */
 	int a, b, c;
@@ -1383,6 +2479,8 @@ int btbb_header_present(const btbb_packet* pkt)
 	/* check that we have enough symbols */
 	if (pkt->length < 122)
 		return 0;
+	/* skip to last bit of sync word */
+	get_symbols(pkt, 63, 59, symbols);
 
 	/* check that the AC trailer is correct */
 	msb = stream[0];
@@ -1415,21 +2513,21 @@ int btbb_header_present(const btbb_packet* pkt)
 uint32_t lap_from_fhs(btbb_packet* pkt)
 {
 	/* caller should check got_payload() and get_type() */
-	return air_to_host32(&pkt->payload[34], 24);
+	return payload_field(pkt, 34, 24);
 }
 
 /* extract UAP from FHS payload */
 uint8_t uap_from_fhs(btbb_packet* pkt)
 {
 	/* caller should check got_payload() and get_type() */
-	return air_to_host8(&pkt->payload[64], 8);
+	return payload_field(pkt, 64, 8);
 }
 
 /* extract NAP from FHS payload */
 uint16_t nap_from_fhs(btbb_packet* pkt)
 {
 	/* caller should check got_payload() and get_type() */
-	return air_to_host8(&pkt->payload[72], 16);
+	return payload_field(pkt, 72, 8);
 }
 
 /* extract clock from FHS payload */
@@ -1441,5 +2539,5 @@ uint32_t clock_from_fhs(btbb_packet* pkt)
 	 * This is CLK2-27 (units of 1.25 ms).
 	 * CLK0 and CLK1 are implicitly zero.
 	 */
-	return air_to_host32(&pkt->payload[115], 26);
+	return payload_field(pkt, 115, 26);
 }
@@ -29,6 +29,13 @@
 /* maximum number of payload bits */
 #define MAX_PAYLOAD_LENGTH 2744
 
+/* words holding 'n' packed symbols, plus a zero word that lets a read of
+ * 64 symbols from any offset below 'n' take two whole words */
+#define SYMBOL_WORDS(n) (((n) + 63) / 64 + 1)
+
+/* a packet's arena holds the most symbols and then the largest payload */
+#define PACKET_ARENA_WORDS (SYMBOL_WORDS(MAX_SYMBOLS) + (MAX_PAYLOAD_LENGTH / 8 + 7) / 8)
+
 /* minimum header bit errors to indicate that this is an ID packet */
 #define ID_THRESHOLD 5
 
@@ -49,38 +56,49 @@
 #define PACKET_TYPE_DM5 14
 #define PACKET_TYPE_DH5 15
 
+/* Fields used on every packet (access code search, UAP/clock discovery,
+ * piconet tracking) come first so that they share a cache line; the
+ * header bits and the packed symbol and payload storage follow. Packets
+ * are allocated aligned to BTBB_PACKET_ALIGN. */
+#define BTBB_PACKET_ALIGN 64
+
 struct btbb_packet {
 
 	uint32_t refcount;
 
 	uint32_t flags;
 
+	uint32_t LAP;    /* lower address part found in access code */
+	uint32_t clock;  /* CLK1-27 of master */
+	uint32_t clkn;   /* native (local) clock, CLK0-27 */
+	uint16_t NAP;    /* non-significant address part */
+	uint16_t length; /* number of symbols */
+
 	uint8_t channel; /* Bluetooth channel (0-79) */
 	uint8_t UAP;     /* upper address part */
-	uint16_t NAP;    /* non-significant address part */
-	uint32_t LAP;    /* lower address part found in access code */
-	
+	uint8_t ac_errors; /* Number of bit errors in the AC */
 	uint8_t modulation; 
 	uint8_t transport;
 	uint8_t packet_type;
 	uint8_t packet_lt_addr; /* LLID field of payload header (2 bits) */
 	uint8_t packet_flags; /* Flags - FLOW/ARQN/SQEN */
 	uint8_t packet_hec; /* Flags - FLOW/ARQN/SQEN */
-	
-	/* packet header, one bit per char */
-	char packet_header[18];
-	
-	/* number of payload header bytes: 0, 1, 2, or -1 for
-	 * unknown. payload is one bit per char. */
-	int payload_header_length;
-	char payload_header[16];
-	
+
 	/* LLID field of payload header (2 bits) */
 	uint8_t payload_llid;
 	
 	/* flow field of payload header (1 bit) */
 	uint8_t payload_flow;
 
+	uint16_t crc;
+
+	/* payload bits the decoders have written, see payload_done() */
+	uint16_t payload_bits;
+
+	/* number of payload header bytes: 0, 1, 2, or -1 for
+	 * unknown. */
+	int payload_header_length;
+
 	/* payload length: the total length of the asynchronous data
 	* in bytes.  This does not include the length of synchronous
 	* data, such as the voice field of a DV packet.  If there is a
@@ -89,27 +107,26 @@ struct btbb_packet {
 	* plus payload_header_length plus 2 bytes CRC (if present).
 	*/
 	int payload_length;
+
+	/* packet header, one bit per char */
+	char packet_header[18];
 	
-	/* The actual payload data in host format
-	* Ready for passing to wireshark
-	* 2744 is the maximum length, but most packets are shorter.
-	* Dynamic allocation would probably be better in the long run but is
-	* problematic in the short run.
-	*/
-	char payload[MAX_PAYLOAD_LENGTH];
+	char payload_header[16];
 
-	uint16_t crc;
-	uint32_t clock; /* CLK1-27 of master */
-	uint32_t clkn;  /* native (local) clock, CLK0-27 */
-	uint8_t ac_errors; /* Number of bit errors in the AC */
+	/* Every field above is cleared when a pooled packet is reused, the
+	 * arena is not. */
 
-	/* the raw symbol stream (less the preamble), one bit per char */
-	//FIXME maybe this should be a vector so we can grow it only
-	//to the size needed and later shrink it if we find we have
-	//more symbols than necessary
-	uint16_t length; /* number of symbols */
-	char symbols[MAX_SYMBOLS];
+	/* the raw symbol stream (less the preamble), packed: symbol i is
+	 * bit i % 64 of word i / 64. It takes SYMBOL_WORDS(length) words
+	 * at the start of the arena, and symbols past 'length' are zero. */
+	uint64_t *symbols;
+
+	/* The actual payload data, packed: bit i is bit i % 8 of byte i / 8,
+	 * so the bytes are ready for passing to wireshark. It takes the rest
+	 * of the arena after the symbols; payload_length bytes are valid. */
+	uint8_t *payload;
 
+	uint64_t arena[PACKET_ARENA_WORDS];
 };
 
 /* type-specific CRC checks and decoding */
@@ -132,6 +149,16 @@ char *tun_format(btbb_packet* p);
  */
 uint8_t try_clock(int clock, btbb_packet* p);
 
+/* try_clock() for all 64 CLK1-6 values at once, filling uaps[64] and
+ * types[64]; returns 0 on header FEC failure
+ */
+int try_clocks(btbb_packet* p, uint8_t *uaps, uint8_t *types);
+
+/* decode the packet header and unwhiten it under every CLK1-6 value
+ * at once, headers[64] receiving 18 bits each; returns 0 on FEC failure
+ */
+int unwhiten_headers(btbb_packet* p, uint32_t *headers);
+
 /* extract LAP from FHS payload */
 uint32_t lap_from_fhs(btbb_packet* p);
 
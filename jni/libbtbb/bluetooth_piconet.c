@@ -25,6 +25,27 @@
 #include "uthash.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <utime.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+#define MAX_HOP_THREADS 16
+
+/* observed hops btbb_winnow() checks per pass over the candidates */
+#define WINNOW_BATCH 8
+/* fewest candidates worth another winnowing thread */
+#define WINNOW_MIN_SLICE 4096
+/* candidates ahead to prefetch sequence entries for */
+#define WINNOW_PREFETCH 16
 
 int perm_table_initialized = 0;
 char perm_table[0x20][0x20][0x200];
@@ -156,23 +177,25 @@ void address_precalc(int address, btbb_piconet *pn)
 		((address >> 1) & 0x01);
 }
 
-#ifdef WC4
-/* These are optimization experiments, which don't help much for
- * x86. Hold on to them to see whether they're useful on ARM. */
-
-#ifdef NEVER
-#define BUTTERFLY(z,p,c,a,b)					     \
-	if ( ((p&(1<<c))!=0) & (((z&(1<<a))!=0) ^ ((z&(1<<b))!=0)) ) \
-		z ^= ((1<<a)|(1<<b))
-#endif
-
+/* Conditionally swap bits a and b of z, if bit c of the control word p
+ * is set. The butterfly network is 14 of these. */
 #define BUTTERFLY(z,p,c,a,b) \
-	if ( (((z>>a)^(z>>b)) & (p>>c)) & 0x1 ) \
-		z ^= ((1<<a)|(1<<b))
+	t = (((z >> a) ^ (z >> b)) & (p >> c)) & 0x1; \
+	z ^= (t << a) | (t << b)
+
+/* The same on bit-sliced z: plane s[i] holds bit i of 32 different z */
+#define BUTTERFLY_SLICED(s,p,c,a,b) \
+	t = (s[a] ^ s[b]) & -(uint32_t) ((p >> c) & 0x1); \
+	s[a] ^= t; \
+	s[b] ^= t
 
+/* 5 bit permutation */
+/* assumes z is constrained to 5 bits, p_high to 5 bits, p_low to 9 bits */
 int perm5(int z, int p_high, int p_low)
 {
-	int p = (p_high << 5) | p_low;
+	/* bits of p_low and p_high are control signals */
+	int t, p = (p_high << 9) | p_low;
+
 	BUTTERFLY(z,p,13,1,2);
 	BUTTERFLY(z,p,12,0,3);
 	BUTTERFLY(z,p,11,1,3);
@@ -190,42 +213,40 @@ int perm5(int z, int p_high, int p_low)
 
 	return z;
 }
-#endif // WC4
 
-/* 5 bit permutation */
-/* assumes z is constrained to 5 bits, p_high to 5 bits, p_low to 9 bits */
-int perm5(int z, int p_high, int p_low)
+/* perm5() of every z = 0-31 at once, for one p_high/p_low */
+static void perm5_all(int p_high, int p_low, uint8_t *out)
 {
-	int i, tmp, output, z_bit[5], p[14];
-	int index1[] = {0, 2, 1, 3, 0, 1, 0, 3, 1, 0, 2, 1, 0, 1};
-	int index2[] = {1, 3, 2, 4, 4, 3, 2, 4, 4, 3, 4, 3, 3, 2};
-
-	/* bits of p_low and p_high are control signals */
-	for (i = 0; i < 9; i++)
-		p[i] = (p_low >> i) & 0x01;
-	for (i = 0; i < 5; i++)
-		p[i+9] = (p_high >> i) & 0x01;
-
-	/* bit swapping will be easier with an array of bits */
-	for (i = 0; i < 5; i++)
-		z_bit[i] = (z >> i) & 0x01;
-
-	/* butterfly operations */
-	for (i = 13; i >= 0; i--) {
-		/* swap bits according to index arrays if control signal tells us to */
-		if (p[i]) {
-			tmp = z_bit[index1[i]];
-			z_bit[index1[i]] = z_bit[index2[i]];
-			z_bit[index2[i]] = tmp;
-		}
+	/* s[i] bit z = bit i of z */
+	uint32_t s[5] = {0xaaaaaaaa, 0xcccccccc, 0xf0f0f0f0, 0xff00ff00, 0xffff0000};
+	uint32_t t;
+	int i, j, z, p = (p_high << 9) | p_low;
+
+	BUTTERFLY_SLICED(s,p,13,1,2);
+	BUTTERFLY_SLICED(s,p,12,0,3);
+	BUTTERFLY_SLICED(s,p,11,1,3);
+	BUTTERFLY_SLICED(s,p,10,2,4);
+	BUTTERFLY_SLICED(s,p, 9,0,3);
+	BUTTERFLY_SLICED(s,p, 8,1,4);
+	BUTTERFLY_SLICED(s,p, 7,3,4);
+	BUTTERFLY_SLICED(s,p, 6,0,2);
+	BUTTERFLY_SLICED(s,p, 5,1,3);
+	BUTTERFLY_SLICED(s,p, 4,0,4);
+	BUTTERFLY_SLICED(s,p, 3,3,4);
+	BUTTERFLY_SLICED(s,p, 2,1,2);
+	BUTTERFLY_SLICED(s,p, 1,2,3);
+	BUTTERFLY_SLICED(s,p, 0,0,1);
+
+	/* swapping bits is linear, so each output is the XOR of the outputs
+	 * for its single bits */
+	out[0] = 0;
+	for (j = 0; j < 5; j++) {
+		t = 0;
+		for (i = 0; i < 5; i++)
+			t |= ((s[i] >> (1 << j)) & 1) << i;
+		for (z = 1 << j; z < 2 << j; z++)
+			out[z] = out[z - (1 << j)] | t;
 	}
-
-	/* reconstruct output from rearranged bits */
-	output = 0;
-	for (i = 0; i < 5; i++)
-		output += z_bit[i] << i;
-
-	return(output);
 }
 
 void perm_table_init(void)
@@ -249,48 +270,92 @@ int fast_perm(int z, int p_high, int p_low)
 	return(perm_table[z][p_high][p_low]);
 }
 
-/* generate the complete hopping sequence */
-static void gen_hops(btbb_piconet *pn)
+/* generate the 64 hops (CLK1-6) sharing CLK7-27 = 'block' */
+static void gen_block(uint32_t block, char *hops, int afh, const btbb_piconet *pn)
 {
 	/* a, b, c, d, e, f, x, y1, y2 are variable names used in section 2.6 of the spec */
 	/* b is already defined */
 	/* e is already defined */
-	int a, c, d, f, x;
-	int h, i, j, k, c_flipped, perm_in, perm_out;
-
-	/* sequence index = clock >> 1 */
-	/* (hops only happen at every other clock value) */
-	int index = 0;
-	f = 0;
-
-	/* nested loops for optimization (not recalculating every variable with every clock tick) */
-	for (h = 0; h < 0x04; h++) { /* clock bits 26-27 */
-		for (i = 0; i < 0x20; i++) { /* clock bits 21-25 */
-			a = pn->a1 ^ i;
-			for (j = 0; j < 0x20; j++) { /* clock bits 16-20 */
-				c = pn->c1 ^ j;
-				c_flipped = c ^ 0x1f;
-				for (k = 0; k < 0x200; k++) { /* clock bits 7-15 */
-					d = pn->d1 ^ k;
-					for (x = 0; x < 0x20; x++) { /* clock bits 2-6 */
-						perm_in = ((x + a) % 32) ^ pn->b;
-						/* y1 (clock bit 1) = 0, y2 = 0 */
-						perm_out = fast_perm(perm_in, c, d);
-						pn->sequence[index] = pn->bank[(perm_out + pn->e + f) % BT_NUM_CHANNELS];
-						if (btbb_piconet_get_flag(pn, BTBB_IS_AFH)) {
-							pn->sequence[index + 1] = pn->sequence[index];
-						} else {
-							/* y1 (clock bit 1) = 1, y2 = 32 */
-							perm_out = fast_perm(perm_in, c_flipped, d);
-							pn->sequence[index + 1] = pn->bank[(perm_out + pn->e + f + 32) % BT_NUM_CHANNELS];
-						}
-						index += 2;
-					}
-					f += 16;
-				}
-			}
+	int a, c, d, x, base, perm_in;
+	uint8_t perm_out[0x20], perm_out_flipped[0x20];
+
+	a = (pn->a1 ^ (block >> 14)) & 0x1f;
+	c = (pn->c1 ^ (block >> 9)) & 0x1f;
+	d = (pn->d1 ^ block) & 0x1ff;
+	/* f = 16 * CLK7-27 */
+	base = (pn->e + (block << 4)) % BT_NUM_CHANNELS;
+
+	/* c and d are fixed for the whole block, so permute all 32 inputs */
+	perm5_all(c, d, perm_out);
+	if (afh) {
+		/* the slave transmits on the master's channel */
+		for (x = 0; x < 0x20; x++) { /* clock bits 2-6 */
+			perm_in = ((x + a) % 32) ^ pn->b;
+			hops[2 * x] = hops[2 * x + 1] =
+				pn->bank[(perm_out[perm_in] + base) % BT_NUM_CHANNELS];
 		}
+		return;
 	}
+	/* y1 (clock bit 1) = 1 flips c, y2 = 32 */
+	perm5_all(c ^ 0x1f, d, perm_out_flipped);
+	for (x = 0; x < 0x20; x++) { /* clock bits 2-6 */
+		perm_in = ((x + a) % 32) ^ pn->b;
+		hops[2 * x] = pn->bank[(perm_out[perm_in] + base) % BT_NUM_CHANNELS];
+		hops[2 * x + 1] = pn->bank[(perm_out_flipped[perm_in] + base + 32) % BT_NUM_CHANNELS];
+	}
+}
+
+static int hop_threads = 0;
+
+void btbb_set_hop_threads(int threads)
+{
+	hop_threads = threads;
+}
+
+typedef struct {
+	btbb_piconet *pn;
+	int afh;
+	int next_task;
+} hop_build;
+
+/* Each task is one value of clock bits 21-27, 2^14 blocks of hops. */
+static void *gen_hops_worker(void *arg)
+{
+	hop_build *build = (hop_build *) arg;
+	uint32_t block, last;
+	int task;
+
+	while ((task = __atomic_fetch_add(&build->next_task, 1, __ATOMIC_RELAXED)) < 0x80) {
+		last = (task + 1) << 14;
+		for (block = task << 14; block < last; block++)
+			gen_block(block, build->pn->sequence + (block << 6),
+				  build->afh, build->pn);
+	}
+	return NULL;
+}
+
+/* generate the complete hopping sequence */
+static void gen_hops(btbb_piconet *pn)
+{
+	hop_build build;
+	pthread_t threads[MAX_HOP_THREADS];
+	int i, num_threads;
+
+	num_threads = hop_threads;
+	if (num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	num_threads = MIN(MAX(num_threads, 1), MAX_HOP_THREADS);
+
+	build.pn = pn;
+	build.afh = btbb_piconet_get_flag(pn, BTBB_IS_AFH);
+	build.next_task = 0;
+	for (i = 1; i < num_threads; i++)
+		if (pthread_create(&threads[i], NULL, gen_hops_worker, &build) != 0)
+			break;
+	num_threads = i;
+	gen_hops_worker(&build);
+	for (i = 1; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
 }
 
 /* Function to calculate piconet hopping patterns and add to hash map */
@@ -307,36 +372,254 @@ void gen_hop_pattern(btbb_piconet *pn)
 	printf("Hopping sequence calculated.\n");
 }
 
+/* residue indexes kept per sequence; each takes HOP_INDEX_SIZE (8 MB) */
+#define HOP_INDEX_SLOTS 4
+
+/* The residue indexes of one sequence. Every hop reversal restart
+ * starts from a new residue, so only the HOP_INDEX_SLOTS most recently
+ * used are kept, and one is only built when its residue comes up a
+ * second time: the first time, a single scan of the sequence is
+ * cheaper than building the index. */
+struct hop_indexes {
+	uint32_t *index[64];  /* hop_residue_index() by CLK1-6, or NULL */
+	uint8_t mapped[64];   /* index[] is a mapped cache file */
+	uint8_t wanted[64];   /* times the residue was asked for, up to 2 */
+	uint32_t last_use[64];
+	uint32_t uses;
+	int count;            /* non-NULL entries in index[] */
+};
+
 /* Container for hopping pattern */
 typedef struct {
     uint64_t key; /* afh flag + address */
     char *sequence;             
+    struct hop_indexes indexes;
     UT_hash_handle hh;
 } hopping_struct;
 
 static hopping_struct *hopping_map = NULL;
 
+static int hop_sequence = BTBB_HOP_SEQUENCE_ON_DEMAND;
+
+void btbb_set_hop_sequence(int mode)
+{
+	hop_sequence = mode;
+}
+
+/* Hop cache files: a header followed by either the whole sequence or
+ * one residue's hop_residue_index(), as laid out in memory, so the file
+ * can be mapped and used in place. A file's modification time is its
+ * last use. Bump HOP_FILE_VERSION whenever a layout changes. */
+#define HOP_FILE_MAGIC   0x53504f4842544242ULL /* "BBTBHOPS" */
+#define HOP_FILE_VERSION 1
+#define HOP_FILE_PREFIX  "btbb-hops-"
+
+/* 'part' of the file holding the sequence; 0-63 are residue indexes */
+#define HOP_FILE_SEQUENCE 64
+
+typedef struct {
+	uint64_t magic;        /* also catches a file from other endianness */
+	uint32_t version;
+	uint32_t part;
+	uint64_t key;
+	uint64_t length;       /* bytes after the header */
+	uint8_t  pad[32];      /* keep the data 64-byte aligned */
+} hop_file_header;
+
+static const char *hop_cache_dir = NULL;
+static uint64_t hop_cache_budget = 0;
+
+void btbb_set_hop_cache(const char *dir, uint64_t max_bytes)
+{
+	hop_cache_dir = dir;
+	hop_cache_budget = max_bytes;
+}
+
+/* AFH flag and address, as used by hopping_map and the file names */
+static uint64_t hop_key(const btbb_piconet *pn)
+{
+	uint64_t key = btbb_piconet_get_flag(pn, BTBB_IS_AFH);
+
+	return (key << 32) | ((uint32_t) pn->UAP << 24) | pn->LAP;
+}
+
+static void hop_file_path(char *path, size_t len, uint64_t key, int part)
+{
+	if (part == HOP_FILE_SEQUENCE)
+		snprintf(path, len, "%s/" HOP_FILE_PREFIX "%09llx.seq",
+			 hop_cache_dir, (unsigned long long) key);
+	else
+		snprintf(path, len, "%s/" HOP_FILE_PREFIX "%09llx.idx%02d",
+			 hop_cache_dir, (unsigned long long) key, part);
+}
+
+/* Map a cache file read-only and mark it used. Fails if it is missing or
+ * does not hold exactly 'length' bytes of 'part' for 'key'. */
+static void *map_hop_file(uint64_t key, int part, uint64_t length)
+{
+	hop_file_header *header;
+	char path[PATH_MAX];
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (hop_cache_dir == NULL)
+		return NULL;
+	hop_file_path(path, sizeof(path), key, part);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (uint64_t) st.st_size != sizeof(hop_file_header) + length) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	header = (hop_file_header *) map;
+	if (header->magic != HOP_FILE_MAGIC
+	    || header->version != HOP_FILE_VERSION
+	    || header->part != (uint32_t) part
+	    || header->key != key
+	    || header->length != length) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	utime(path, NULL);
+	return header + 1;
+}
+
+/* Undo map_hop_file() */
+static void unmap_hop_file(void *data, uint64_t length)
+{
+	munmap((hop_file_header *) data - 1, sizeof(hop_file_header) + length);
+}
+
+/* Remove least recently used cache files until they fit the budget */
+static void evict_hop_files(void)
+{
+	char path[PATH_MAX], oldest_path[PATH_MAX];
+	struct dirent *entry;
+	struct stat st;
+	uint64_t total;
+	time_t oldest_time = 0;
+	DIR *dir;
+
+	if (hop_cache_budget == 0)
+		return;
+	dir = opendir(hop_cache_dir);
+	if (dir == NULL)
+		return;
+	for (;;) {
+		total = 0;
+		oldest_path[0] = '\0';
+		rewinddir(dir);
+		while ((entry = readdir(dir)) != NULL) {
+			/* skip other files, and files still being written */
+			if (strncmp(entry->d_name, HOP_FILE_PREFIX, strlen(HOP_FILE_PREFIX))
+			    || strstr(entry->d_name, ".tmp"))
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", hop_cache_dir, entry->d_name);
+			if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+				continue;
+			total += st.st_size;
+			if (!oldest_path[0] || st.st_mtime < oldest_time) {
+				strcpy(oldest_path, path);
+				oldest_time = st.st_mtime;
+			}
+		}
+		if (total <= hop_cache_budget || !oldest_path[0])
+			break;
+		/* mappings of the file stay valid after it is removed */
+		if (unlink(oldest_path) < 0)
+			break;
+	}
+	closedir(dir);
+}
+
+static void write_hop_file(uint64_t key, int part, const void *data, uint64_t length)
+{
+	hop_file_header header;
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	FILE *fp;
+	int fd, ok;
+
+	if (hop_cache_dir == NULL)
+		return;
+	memset(&header, 0, sizeof(header));
+	header.magic = HOP_FILE_MAGIC;
+	header.version = HOP_FILE_VERSION;
+	header.part = part;
+	header.key = key;
+	header.length = length;
+
+	/* write a uniquely named temporary file and rename it, so a reader
+	 * never maps a partial file and concurrent writers never share one */
+	hop_file_path(path, sizeof(path), key, part);
+	snprintf(tmp, sizeof(tmp), "%s.tmpXXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	fchmod(fd, 0644);
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& fwrite(data, 1, length, fp) == length;
+	ok = (fclose(fp) == 0) && ok;
+	if (ok)
+		ok = rename(tmp, path) == 0;
+	if (!ok) {
+		unlink(tmp);
+		fprintf(stderr, "Could not write hopping sequence cache %s\n", path);
+		return;
+	}
+	evict_hop_files();
+}
+
 /* Function to fetch piconet hopping patterns */
 void get_hop_pattern(btbb_piconet *pn)
 {
        hopping_struct *s;
        uint64_t key;
 
-	   /* Two stages to avoid "left shift count >= width of type" warning */
-       key = btbb_piconet_get_flag(pn, BTBB_IS_AFH);
-       key = (key<<32) | (pn->UAP<<24) | pn->LAP;
-       HASH_FIND(hh, hopping_map, &key, 4, s);
+       if (hop_sequence == BTBB_HOP_SEQUENCE_ON_DEMAND) {
+               /* hops are computed from these as they are needed */
+               precalc(pn);
+               address_precalc(((pn->UAP<<24) | pn->LAP) & 0xfffffff, pn);
+               memset(pn->hop_block_tag, 0, sizeof(pn->hop_block_tag));
+               /* build fast_perm()'s table before winnowing threads share it */
+               fast_perm(0, 0, 0);
+               pn->sequence = NULL;
+               pn->hop_index = NULL;
+               return;
+       }
+
+       key = hop_key(pn);
+       HASH_FIND(hh, hopping_map, &key, sizeof(uint64_t), s);
        
        if (s == NULL) {
-               gen_hop_pattern(pn);
-               s = malloc(sizeof(hopping_struct));
+               s = calloc(1, sizeof(hopping_struct));
                s->key = key;
-               s->sequence = pn->sequence;
-               HASH_ADD(hh, hopping_map, key, 4, s);
+               s->sequence = (char *) map_hop_file(key, HOP_FILE_SEQUENCE, SEQUENCE_LENGTH);
+               if (s->sequence) {
+                       printf("\nFound hopping sequence in %s.\n", hop_cache_dir);
+               } else {
+                       gen_hop_pattern(pn);
+                       s->sequence = pn->sequence;
+                       write_hop_file(key, HOP_FILE_SEQUENCE, s->sequence, SEQUENCE_LENGTH);
+               }
+               HASH_ADD(hh, hopping_map, key, sizeof(uint64_t), s);
        } else {
                printf("\nFound hopping sequence in cache.\n");
-               pn->sequence = s->sequence;
        }
+       pn->sequence = s->sequence;
+       pn->hop_index = &s->indexes;
 }
 
 /* determine channel for a particular hop */
@@ -360,10 +643,41 @@ char single_hop(int clock, btbb_piconet *pn)
 	return(pn->bank[(fast_perm(((x + a) % 32) ^ pn->b, (y1 * 0x1f) ^ c, d) + pn->e + f + y2) % BT_NUM_CHANNELS]);
 }
 
+/* channel for CLK1-27 'index' without the full sequence */
+static char hop_at(uint32_t index, btbb_piconet *pn)
+{
+	/* with AFH, the slave transmits on the master's channel */
+	if (btbb_piconet_get_flag(pn, BTBB_IS_AFH))
+		index &= ~1;
+	return single_hop(index << 1, pn);
+}
+
 /* look up channel for a particular hop */
 char hop(int clock, btbb_piconet *pn)
 {
-	return pn->sequence[clock];
+	uint32_t block, slot;
+
+	if (pn->sequence)
+		return pn->sequence[clock];
+
+	/* consecutive hops mostly fall in the same block of 64 */
+	block = ((uint32_t) clock >> 6) & 0x1fffff;
+	slot = block % HOP_CACHE_BLOCKS;
+	if (pn->hop_block_tag[slot] != block + 1) {
+		gen_block(block, pn->hop_block[slot],
+			  btbb_piconet_get_flag(pn, BTBB_IS_AFH), pn);
+		pn->hop_block_tag[slot] = block + 1;
+	}
+	return pn->hop_block[slot][clock & 0x3f];
+}
+
+/* like hop(), for scans that touch one hop per block and would only
+ * thrash the block cache */
+static char scan_hop(uint32_t index, btbb_piconet *pn)
+{
+	if (pn->sequence)
+		return pn->sequence[index];
+	return hop_at(index, pn);
 }
 
 static char aliased_channel(char channel)
@@ -371,6 +685,124 @@ static char aliased_channel(char channel)
 		return ((channel + 24) % ALIASED_CHANNELS) + 26;
 }
 
+/* bytes in one residue's index */
+#define HOP_INDEX_SIZE ((BT_NUM_CHANNELS + 1 + RESIDUE_POSITIONS) * sizeof(uint32_t))
+
+/* Drop the least recently used residue index other than 'keep' */
+static void evict_hop_index(struct hop_indexes *h, int keep)
+{
+	int residue, oldest = -1;
+
+	for (residue = 0; residue < 64; residue++)
+		if (residue != keep && h->index[residue]
+		    && (oldest < 0 || h->last_use[residue] < h->last_use[oldest]))
+			oldest = residue;
+	if (oldest < 0)
+		return;
+	if (h->mapped[oldest])
+		unmap_hop_file(h->index[oldest], HOP_INDEX_SIZE);
+	else
+		free(h->index[oldest]);
+	h->index[oldest] = NULL;
+	h->mapped[oldest] = 0;
+	h->count--;
+}
+
+static void keep_hop_index(struct hop_indexes *h, int residue, uint32_t *index, int mapped)
+{
+	if (h->count >= HOP_INDEX_SLOTS)
+		evict_hop_index(h, residue);
+	h->index[residue] = index;
+	h->mapped[residue] = mapped;
+	h->count++;
+}
+
+/* Inverted index of the positions in pn->sequence with CLK1-6 = 'residue':
+ * BT_NUM_CHANNELS + 1 list offsets, then the positions themselves, those
+ * on channel c (ascending) from offset index[c] up to index[c + 1].
+ * Returns NULL if the caller should scan the sequence instead. */
+static uint32_t *hop_residue_index(int residue, btbb_piconet *pn)
+{
+	struct hop_indexes *h = pn->hop_index;
+	uint32_t *index = h->index[residue];
+	uint32_t *positions;
+	uint32_t i;
+	int channel;
+
+	h->last_use[residue] = ++h->uses;
+	if (index)
+		return index;
+	index = (uint32_t *) map_hop_file(hop_key(pn), residue, HOP_INDEX_SIZE);
+	if (index) {
+		keep_hop_index(h, residue, index, 1);
+		return index;
+	}
+	if (h->wanted[residue] < 2)
+		h->wanted[residue]++;
+	if (h->wanted[residue] < 2)
+		return NULL;
+	index = (uint32_t *) calloc(1, HOP_INDEX_SIZE);
+	if (!index)
+		return NULL;
+	positions = index + BT_NUM_CHANNELS + 1;
+
+	/* counting sort of the residue's positions by channel */
+	for (i = residue; i < SEQUENCE_LENGTH; i += 0x40)
+		index[pn->sequence[i] + 1]++;
+	for (channel = 1; channel <= BT_NUM_CHANNELS; channel++)
+		index[channel] += index[channel - 1];
+	for (i = residue; i < SEQUENCE_LENGTH; i += 0x40)
+		positions[index[(int) pn->sequence[i]]++] = i;
+	/* filling advanced each start to the next channel's start */
+	for (channel = BT_NUM_CHANNELS; channel > 0; channel--)
+		index[channel] = index[channel - 1];
+	index[0] = 0;
+
+	keep_hop_index(h, residue, index, 0);
+	write_hop_file(hop_key(pn), residue, index, HOP_INDEX_SIZE);
+	return index;
+}
+
+/* initial candidates from the inverted index, merging the lists of all
+ * channels that alias to the observed one */
+static int indexed_candidates(char channel, int known_clock_bits, btbb_piconet *pn)
+{
+	uint32_t *index, *positions;
+	uint32_t next[BT_NUM_CHANNELS];
+	int lists[BT_NUM_CHANNELS];
+	int i, num_lists = 0, best, count = 0;
+
+	index = hop_residue_index(known_clock_bits, pn);
+	if (!index)
+		return -1;
+	positions = index + BT_NUM_CHANNELS + 1;
+
+	for (i = 0; i < BT_NUM_CHANNELS; i++) {
+		if ((pn->aliased ? aliased_channel(i) : i) != channel)
+			continue;
+		next[num_lists] = index[i];
+		lists[num_lists++] = i;
+	}
+	if (num_lists == 1) {
+		count = index[lists[0] + 1] - index[lists[0]];
+		memcpy(pn->clock_candidates, &positions[index[lists[0]]], count * sizeof(uint32_t));
+		return count;
+	}
+
+	/* keep the ascending order init_candidates() would produce */
+	for (;;) {
+		best = -1;
+		for (i = 0; i < num_lists; i++)
+			if (next[i] < index[lists[i] + 1] &&
+			    (best < 0 || positions[next[i]] < positions[next[best]]))
+				best = i;
+		if (best < 0)
+			break;
+		pn->clock_candidates[count++] = positions[next[best]++];
+	}
+	return count;
+}
+
 /* create list of initial candidate clock values (hops with same channel as first observed hop) */
 static int init_candidates(char channel, int known_clock_bits, btbb_piconet *pn)
 {
@@ -378,12 +810,19 @@ static int init_candidates(char channel, int known_clock_bits, btbb_piconet *pn)
 	int count = 0; /* total number of candidates */
 	char observable_channel; /* accounts for aliasing if necessary */
 
+	if (pn->hop_index) {
+		count = indexed_candidates(channel, known_clock_bits, pn);
+		if (count >= 0)
+			return count;
+		count = 0;
+	}
+
 	/* only try clock values that match our known bits */
 	for (i = known_clock_bits; i < SEQUENCE_LENGTH; i += 0x40) {
 		if (pn->aliased)
-			observable_channel = aliased_channel(pn->sequence[i]);
+			observable_channel = aliased_channel(scan_hop(i, pn));
 		else
-			observable_channel = pn->sequence[i];
+			observable_channel = scan_hop(i, pn);
 		if (observable_channel == channel)
 			pn->clock_candidates[count++] = i;
 		//FIXME ought to throw exception if count gets too big
@@ -472,6 +911,7 @@ static void reset(btbb_piconet *pn)
 	if(btbb_piconet_get_flag(pn, BTBB_HOP_REVERSAL_INIT)) {
 		free(pn->clock_candidates);
 		pn->sequence = NULL;
+		pn->hop_index = NULL;
 	}
 	btbb_piconet_set_flag(pn, BTBB_GOT_FIRST_PACKET, 0);
 	btbb_piconet_set_flag(pn, BTBB_HOP_REVERSAL_INIT, 0);
@@ -492,42 +932,131 @@ static void reset(btbb_piconet *pn)
 	//	pn->afh_map[i] = 0;
 }
 
-/* narrow a list of candidate clock values based on a single observed hop */
-static int channel_winnow(int offset, char channel, btbb_piconet *pn)
+typedef struct {
+	btbb_piconet *pn;
+	int num_hops;
+	int offsets[WINNOW_BATCH];
+	char channels[WINNOW_BATCH];
+	uint8_t *matched;       /* hops matched in a row, per candidate */
+} winnow_batch;
+
+typedef struct {
+	winnow_batch *batch;
+	int first, last;        /* this thread's slice of clock_candidates */
+	int histogram[WINNOW_BATCH + 1];
+	int threshold;          /* keep candidates matching this many hops */
+	int kept;
+} winnow_slice;
+
+/* count the leading hops of the batch each candidate matches */
+static void *winnow_match(void *arg)
 {
-	int i;
-	int new_count = 0; /* number of candidates after winnowing */
+	winnow_slice *slice = (winnow_slice *) arg;
+	winnow_batch *batch = slice->batch;
+	btbb_piconet *pn = batch->pn;
+	uint32_t *candidates = pn->clock_candidates;
 	char observable_channel; /* accounts for aliasing if necessary */
-
-	/* check every candidate */
-	for (i = 0; i < pn->num_candidates; i++) {
-		if (pn->aliased)
-			observable_channel = aliased_channel(pn->sequence[(pn->clock_candidates[i] + offset) % SEQUENCE_LENGTH]);
-		else
-			observable_channel = pn->sequence[(pn->clock_candidates[i] + offset) % SEQUENCE_LENGTH];
-		if (observable_channel == channel) {
-			/* this candidate matches the latest hop */
-			/* blow away old list of candidates with new one */
-			/* safe because new_count can never be greater than i */
-			pn->clock_candidates[new_count++] = pn->clock_candidates[i];
+	int i, k;
+
+	memset(slice->histogram, 0, sizeof(slice->histogram));
+	for (i = slice->first; i < slice->last; i++) {
+		/* the sequence is too big for the cache: fetch ahead */
+		if (pn->sequence && i + WINNOW_PREFETCH < slice->last)
+			__builtin_prefetch(&pn->sequence[(candidates[i + WINNOW_PREFETCH]
+				+ batch->offsets[0]) % SEQUENCE_LENGTH]);
+		for (k = 0; k < batch->num_hops; k++) {
+			if (pn->aliased)
+				observable_channel = aliased_channel(scan_hop((candidates[i] + batch->offsets[k]) % SEQUENCE_LENGTH, pn));
+			else
+				observable_channel = scan_hop((candidates[i] + batch->offsets[k]) % SEQUENCE_LENGTH, pn);
+			if (observable_channel != batch->channels[k])
+				break;
 		}
+		batch->matched[i] = k;
+		slice->histogram[k]++;
 	}
-	pn->num_candidates = new_count;
+	return NULL;
+}
+
+/* drop the slice's candidates below the threshold, keeping their order */
+static void *winnow_keep(void *arg)
+{
+	winnow_slice *slice = (winnow_slice *) arg;
+	uint32_t *candidates = slice->batch->pn->clock_candidates;
+	uint8_t *matched = slice->batch->matched;
+	int i, kept = slice->first;
+
+	for (i = slice->first; i < slice->last; i++)
+		if (matched[i] >= slice->threshold)
+			candidates[kept++] = candidates[i];
+	slice->kept = kept - slice->first;
+	return NULL;
+}
 
-	if (new_count == 1) {
-		// Calculate clock offset for CLKN, not CLK1-27
-		pn->clk_offset = ((pn->clock_candidates[0]<<1) - (pn->first_pkt_time<<1));
-		printf("\nAcquired CLK1-27 = 0x%07x\n", pn->clock_candidates[0]);
-		btbb_piconet_set_flag(pn, BTBB_CLK27_VALID, 1);
+static void run_slices(void *(*fn)(void *), winnow_slice *slices, int num_slices)
+{
+	pthread_t threads[MAX_HOP_THREADS];
+	int i, started;
+
+	for (started = 1; started < num_slices; started++)
+		if (pthread_create(&threads[started], NULL, fn, &slices[started]) != 0)
+			break;
+	/* do whatever could not get a thread here */
+	for (i = started; i < num_slices; i++)
+		fn(&slices[i]);
+	fn(&slices[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/* Narrow the list of candidate clock values by up to WINNOW_BATCH
+ * observed hops in one pass over the list. Hops are applied as if one
+ * at a time, up to and including the first that leaves at most one
+ * candidate; returns the number of hops applied. */
+static int channel_winnow(winnow_batch *batch, btbb_piconet *pn)
+{
+	winnow_slice slices[MAX_HOP_THREADS];
+	int survivors[WINNOW_BATCH + 1];
+	int i, k, used, num_slices, new_count;
+
+	num_slices = hop_threads;
+	if (num_slices <= 0)
+		num_slices = sysconf(_SC_NPROCESSORS_ONLN);
+	num_slices = MIN(num_slices, pn->num_candidates / WINNOW_MIN_SLICE);
+	num_slices = MIN(MAX(num_slices, 1), MAX_HOP_THREADS);
+
+	for (i = 0; i < num_slices; i++) {
+		slices[i].batch = batch;
+		slices[i].first = (int64_t) pn->num_candidates * i / num_slices;
+		slices[i].last = (int64_t) pn->num_candidates * (i + 1) / num_slices;
 	}
-	else if (new_count == 0) {
-		reset(pn);
+	run_slices(winnow_match, slices, num_slices);
+
+	/* survivors[k]: candidates matching the first k hops */
+	survivors[batch->num_hops] = 0;
+	for (i = 0; i < num_slices; i++)
+		survivors[batch->num_hops] += slices[i].histogram[batch->num_hops];
+	for (k = batch->num_hops - 1; k >= 0; k--) {
+		survivors[k] = survivors[k + 1];
+		for (i = 0; i < num_slices; i++)
+			survivors[k] += slices[i].histogram[k];
 	}
-	//else {
-	//printf("%d CLK1-27 candidates remaining (channel=%d)\n", new_count, channel);
-	//}
+	for (used = 1; used < batch->num_hops && survivors[used] > 1; used++)
+		;
+	new_count = survivors[used];
+
+	for (i = 0; i < num_slices; i++)
+		slices[i].threshold = used;
+	run_slices(winnow_keep, slices, num_slices);
+	/* close the gaps between slices; each moves towards the front */
+	for (i = 1, k = slices[0].kept; i < num_slices; i++) {
+		memmove(&pn->clock_candidates[k], &pn->clock_candidates[slices[i].first],
+			slices[i].kept * sizeof(uint32_t));
+		k += slices[i].kept;
+	}
+	pn->num_candidates = new_count;
 
-	return new_count;
+	return used;
 }
 
 /* narrow a list of candidate clock values based on all observed hops */
@@ -536,31 +1065,60 @@ int btbb_winnow(btbb_piconet *pn)
 	int new_count = pn->num_candidates;
 	int index, last_index;
 	uint8_t channel, last_channel;
+	winnow_batch batch;
+	int k, used;
+
+	batch.pn = pn;
+	batch.matched = NULL;
+	while (pn->winnowed < pn->packets_observed) {
+		batch.num_hops = MIN(pn->packets_observed - pn->winnowed, WINNOW_BATCH);
+		for (k = 0; k < batch.num_hops; k++) {
+			batch.offsets[k] = pn->pattern_indices[pn->winnowed + k];
+			batch.channels[k] = pn->pattern_channels[pn->winnowed + k];
+		}
+		if (!batch.matched)
+			batch.matched = (uint8_t *) malloc(pn->num_candidates + 1);
+		used = channel_winnow(&batch, pn);
+		new_count = pn->num_candidates;
 
-	for (; pn->winnowed < pn->packets_observed; pn->winnowed++) {
-		index = pn->pattern_indices[pn->winnowed];
-		channel = pn->pattern_channels[pn->winnowed];
-		new_count = channel_winnow(index, channel, pn);
-		if (new_count <= 1)
-			break;
-
-		if (pn->packets_observed > 0) {
-			last_index = pn->pattern_indices[pn->winnowed - 1];
-			last_channel = pn->pattern_channels[pn->winnowed - 1];
-			/*
-			 * Two packets in a row on the same channel should only
-			 * happen if adaptive frequency hopping is in use.
-			 * There can be false positives, though, especially if
-			 * there is aliasing.
-			 */
-			if (!btbb_piconet_get_flag(pn, BTBB_LOOKS_LIKE_AFH)
-			    && (index == last_index + 1)
-			    && (channel == last_channel)) {
-				btbb_piconet_set_flag(pn, BTBB_LOOKS_LIKE_AFH, 1);
-				printf("Hopping pattern appears to be AFH\n");
+		for (k = 0; k < used; k++) {
+			if (k == used - 1 && new_count <= 1)
+				break;
+			index = pn->pattern_indices[pn->winnowed];
+			channel = pn->pattern_channels[pn->winnowed];
+
+			if (pn->packets_observed > 0) {
+				last_index = pn->pattern_indices[pn->winnowed - 1];
+				last_channel = pn->pattern_channels[pn->winnowed - 1];
+				/*
+				 * Two packets in a row on the same channel should only
+				 * happen if adaptive frequency hopping is in use.
+				 * There can be false positives, though, especially if
+				 * there is aliasing.
+				 */
+				if (!btbb_piconet_get_flag(pn, BTBB_LOOKS_LIKE_AFH)
+				    && (index == last_index + 1)
+				    && (channel == last_channel)) {
+					btbb_piconet_set_flag(pn, BTBB_LOOKS_LIKE_AFH, 1);
+					printf("Hopping pattern appears to be AFH\n");
+				}
 			}
+			pn->winnowed++;
+		}
+
+		if (new_count == 1) {
+			// Calculate clock offset for CLKN, not CLK1-27
+			pn->clk_offset = ((pn->clock_candidates[0]<<1) - (pn->first_pkt_time<<1));
+			printf("\nAcquired CLK1-27 = 0x%07x\n", pn->clock_candidates[0]);
+			btbb_piconet_set_flag(pn, BTBB_CLK27_VALID, 1);
+		}
+		else if (new_count == 0) {
+			reset(pn);
 		}
+		if (new_count <= 1)
+			break;
 	}
+	free(batch.matched);
 	
 	return new_count;
 }
@@ -569,7 +1127,9 @@ int btbb_winnow(btbb_piconet *pn)
 int btbb_uap_from_header(btbb_packet *pkt, btbb_piconet *pn)
 {
 	uint8_t UAP;
+	uint8_t uaps[64], types[64];
 	int count, crc_chk, first_clock = 0;
+	int have_header;
 
 	int starting = 0;
 	int remaining = 0;
@@ -592,6 +1152,9 @@ int btbb_uap_from_header(btbb_packet *pkt, btbb_piconet *pn)
 	pn->packets_observed++;
 	pn->total_packets_observed++;
 
+	/* unwhiten the header under every clock value in one pass */
+	have_header = try_clocks(pkt, uaps, types);
+
 	/* try every possible first packet clock value */
 	for (count = 0; count < 64; count++) {
 		/* skip eliminated candidates unless this is our first time through */
@@ -600,18 +1163,22 @@ int btbb_uap_from_header(btbb_packet *pkt, btbb_piconet *pn)
 			/* clock value for the current packet assuming count was the clock of the first packet */
 			int clock = (count + clkn - pn->first_pkt_time) % 64;
 			starting++;
-			UAP = try_clock(clock, pkt);
+			UAP = 0;
+			if (have_header) {
+				UAP = pkt->UAP = uaps[clock];
+				pkt->packet_type = types[clock];
+			}
 			crc_chk = -1;
 
+			/* a known UAP rules a candidate out before its CRC */
 			/* if this is the first packet: populate the candidate list */
 			/* if not: check CRCs if UAPs match */
-			if (!btbb_piconet_get_flag(pn, BTBB_GOT_FIRST_PACKET)
-				|| UAP == pn->clock6_candidates[count])
-				crc_chk = crc_check(clock, pkt);
-
 			if (btbb_piconet_get_flag(pn, BTBB_UAP_VALID) &&
 			    (UAP != pn->UAP))
 				crc_chk = -1;
+			else if (!btbb_piconet_get_flag(pn, BTBB_GOT_FIRST_PACKET)
+				|| UAP == pn->clock6_candidates[count])
+				crc_chk = crc_check(clock, pkt);
 
 			switch(crc_chk) {
 			case -1: /* UAP mismatch */
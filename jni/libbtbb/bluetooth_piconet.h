@@ -29,6 +29,9 @@
 /* number of channels in use */
 #define BT_NUM_CHANNELS 79
 
+/* blocks of on-demand hops kept per piconet */
+#define HOP_CACHE_BLOCKS 16
+
 struct btbb_piconet {
 
 	uint32_t refcount;
@@ -63,9 +66,18 @@ struct btbb_piconet {
 	/* frequency register bank */
 	int bank[BT_NUM_CHANNELS];
 
-	/* this holds the entire hopping sequence */
+	/* this holds the entire hopping sequence, or NULL when hops are
+	 * computed on demand */
 	char *sequence;
 
+	/* per CLK1-6 residue, the positions of each channel in 'sequence'
+	 * (see hop_residue_index()), shared with the sequence cache */
+	struct hop_indexes *hop_index;
+
+	/* recently computed blocks of 64 hops (CLK1-6), tagged by CLK7-27 + 1 */
+	uint32_t hop_block_tag[HOP_CACHE_BLOCKS];
+	char hop_block[HOP_CACHE_BLOCKS][64];
+
 	/* number of candidates for CLK1-27 */
 	int num_candidates;
 
@@ -98,6 +110,9 @@ struct btbb_piconet {
 /* number of hops in the hopping sequence (i.e. number of possible values of CLK1-27) */
 #define SEQUENCE_LENGTH 134217728
 
+/* number of positions with each CLK1-6 residue */
+#define RESIDUE_POSITIONS (SEQUENCE_LENGTH / 64)
+
 /* number of aliased channels received */
 #define ALIASED_CHANNELS 25
 
@@ -118,7 +133,7 @@ int perm5(int z, int p_high, int p_low);
 /* replaced with gen_hops() for a complete sequence but could still come in handy */
 char single_hop(int clock, btbb_piconet *pnet);
 
-/* look up channel for a particular hop */
+/* look up channel for a particular hop (CLK1-27) */
 char hop(int clock, btbb_piconet *pnet);
 
 void try_hop(btbb_packet *pkt, btbb_piconet *pn);
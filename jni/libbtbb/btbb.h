@@ -23,6 +23,7 @@
 #define INCLUDED_BTBB_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 #define BTBB_WHITENED    0
 #define BTBB_NAP_VALID   1
@@ -73,6 +74,29 @@ typedef struct btbb_packet btbb_packet;
  * reasonable. */
 int btbb_init(int max_ac_errors);
 
+/* Have btbb_init() map its syndrome table read-only from 'path', so
+ * that startup is quick and processes share the pages. If the file is
+ * missing, stale or built for fewer errors, the table is built as usual
+ * and written there for next time. Call before btbb_init(). */
+void btbb_set_syndrome_file(const char *path);
+
+/* Build the syndrome table for 'max_ac_errors' and write it to 'path'.
+ * Returns 0 on success, negative on error. */
+int btbb_write_syndrome_file(const char *path, int max_ac_errors);
+
+/* Number of threads btbb_init() uses to build the syndrome table;
+ * 0 (the default) means one per online CPU. */
+void btbb_set_syndrome_threads(int threads);
+
+/* If set, btbb_init() only builds syndromes for up to 2 errors before
+ * returning, and fills in the higher error levels in a background
+ * thread. Searches see the full table once it is complete. */
+void btbb_set_syndrome_lazy(int lazy);
+
+/* Print the size of the syndrome table built by btbb_init(), and the
+ * probes and time taken to look up every syndrome, per error level. */
+void btbb_print_syndrome_stats(FILE *fp);
+
 char *btbb_get_release(void);
 char *btbb_get_version(void);
 
@@ -93,6 +117,34 @@ int btbb_find_ac(char *stream,
 	       uint32_t lap,
 	       int max_ac_errors,
 	       btbb_packet **pkt);
+
+/* Search for a packet from any of 'num_laps' LAPs (at most
+ * BTBB_MAX_SEARCH_LAPS) in a single pass over the stream. Otherwise
+ * the same as btbb_find_ac() with a known LAP. */
+int btbb_find_ac_multi(char *stream,
+		     int search_length,
+		     const uint32_t *laps,
+		     int num_laps,
+		     int max_ac_errors,
+		     btbb_packet **pkt);
+#define BTBB_MAX_SEARCH_LAPS 16
+
+/* How btbb_find_ac() looks for a known LAP: rebuild the candidate sync
+ * word at every offset, or shift one symbol into it (the default). Both
+ * give the same results. */
+#define BTBB_LAP_SEARCH_NAIVE   0
+#define BTBB_LAP_SEARCH_SLIDING 1
+void btbb_set_lap_search(int mode);
+
+/* Same as btbb_find_ac(), but on a packed symbol stream: one symbol per
+ * bit, in air order starting at the least significant bit of stream[0].
+ * The stream must hold at least search_length + 64 symbols, rounded up
+ * to whole words, plus one more word. */
+int btbb_find_ac_packed(const uint64_t *stream,
+		      int search_length,
+		      uint32_t lap,
+		      int max_ac_errors,
+		      btbb_packet **pkt);
 #define LAP_ANY 0xffffffffUL
 #define UAP_ANY 0xff
 
@@ -120,12 +172,32 @@ void btbb_packet_set_data(btbb_packet *pkt,
 			  uint8_t channel, // Bluetooth channel 0-79
 			  uint32_t clkn);  // 312.5us clock (CLK27-0)
 
-/* Get a pointer to packet symbols. */
+/* How btbb_find_ac_packed() looks for LAP_ANY: test the Barker code
+ * and syndrome one offset at a time, or test the Barker code for 64
+ * offsets at once with bit-sliced logic and then take the syndromes of
+ * all that pass together (the default). Both give the same results. */
+#define BTBB_PROMISC_SEARCH_SCALAR    0
+#define BTBB_PROMISC_SEARCH_BITSLICED 1
+void btbb_set_promisc_search(int mode);
+
+/* Same as btbb_packet_set_data(), taking 'length' symbols from a packed
+ * stream (see btbb_find_ac_packed()) starting at symbol 'offset'. */
+void btbb_packet_set_data_packed(btbb_packet *pkt,
+				 const uint64_t *syms,
+				 int offset,
+				 int length,
+				 uint8_t channel,
+				 uint32_t clkn);
+
+/* Get a pointer to packet symbols, one per char. The packet keeps them
+ * packed, so they are unpacked to a buffer that stays valid until the
+ * next btbb_get_symbols() call on the same thread. */
 const char *btbb_get_symbols(const btbb_packet* pkt);
 
 int btbb_packet_get_payload_length(const btbb_packet* pkt);
 
-/* Get a pointer to payload. */
+/* Get a pointer to payload, one bit per char. Unpacked like the symbols,
+ * valid until the next btbb_get_payload() call on the same thread. */
 const char *btbb_get_payload(const btbb_packet* pkt);
 
 /* Pack the payload in to bytes */
@@ -204,6 +276,26 @@ int btbb_init_hop_reversal(int aliased, btbb_piconet *pn);
 /* narrow a list of candidate clock values based on all observed hops */
 int btbb_winnow(btbb_piconet *pn);
 
+/* How hop reversal gets the hopping sequence: compute each hop when it
+ * is needed (the default), or generate all 2^27 hops (128 MB) up front.
+ * Both give the same results. */
+#define BTBB_HOP_SEQUENCE_ON_DEMAND 0
+#define BTBB_HOP_SEQUENCE_FULL      1
+void btbb_set_hop_sequence(int mode);
+
+/* Keep full hopping sequences (and their candidate indexes) in files
+ * under 'dir', mapped read-only, so that a piconet seen before does not
+ * need its sequence generated again. Least recently used files are
+ * removed to keep them under 'max_bytes' in total (0 for no limit).
+ * A sequence takes 128 MB and each index 8 MB. An index is only built
+ * for a CLK1-6 residue hop reversal has started from before, and at
+ * most four are kept in memory per sequence. */
+void btbb_set_hop_cache(const char *dir, uint64_t max_bytes);
+
+/* Number of threads used to generate a full hopping sequence and to
+ * winnow clock candidates; 0 (the default) means one per online CPU. */
+void btbb_set_hop_threads(int threads);
+
 int btbb_init_survey(void);
 /* Destructively iterate over survey results - optionally remove elements */
 btbb_piconet *btbb_next_survey_result(void);
@@ -229,6 +321,12 @@ int btbb_pcapng_close(btbb_pcapng_handle * h);
 typedef struct lell_packet lell_packet;
 /* decode and allocate LE packet */
 void lell_allocate_and_decode(const uint8_t *stream, uint16_t phys_channel, uint32_t clk100ns, lell_packet **pkt);
+/* decode LE packet into a packet the caller already holds */
+void lell_decode_into(const uint8_t *stream, uint16_t phys_channel, uint32_t clk100ns, lell_packet *pkt);
+/* access address offenses of a raw LE packet, without decoding it */
+unsigned lell_stream_aa_offenses(const uint8_t *stream, uint16_t phys_channel);
+/* data channel access address offenses for each of 'count' addresses */
+void lell_aa_offenses(const uint32_t *aa, unsigned *offenses, int count);
 lell_packet *lell_packet_new(void);
 void lell_packet_ref(lell_packet *pkt);
 void lell_packet_unref(lell_packet *pkt);
@@ -240,6 +338,30 @@ unsigned lell_get_channel_k(const lell_packet *pkt);
 const char * lell_get_adv_type_str(const lell_packet *pkt);
 void lell_print(const lell_packet *pkt);
 
+/* BLE connections seen so far, keyed by access address */
+typedef struct lell_tracker lell_tracker;
+typedef struct {
+	uint32_t access_address;
+	uint32_t crc_init;      /* from CONNECT_REQ */
+	uint16_t interval;      /* hop interval, 1.25 ms units */
+	uint8_t hop_increment;  /* from CONNECT_REQ */
+	uint8_t channel_map[5];
+	uint8_t params_known;   /* CONNECT_REQ seen */
+	uint32_t first_seen;    /* clk100ns */
+	uint32_t last_seen;     /* clk100ns */
+	uint32_t packets;       /* data channel packets */
+} lell_connection;
+/* track up to 'capacity' connections, least recently seen evicted first */
+lell_tracker *lell_tracker_new(unsigned capacity);
+void lell_tracker_free(lell_tracker *t);
+/* feed a decoded packet; packets with a bad access address are ignored */
+void lell_tracker_update(lell_tracker *t, const lell_packet *pkt);
+/* copy out one connection, returns 0 if it is not tracked */
+int lell_tracker_find(lell_tracker *t, uint32_t access_address, lell_connection *conn);
+/* copy out up to 'max' connections seen within 'max_age' (100 ns units)
+ * of the latest packet, returns how many */
+int lell_tracker_live(lell_tracker *t, uint32_t max_age, lell_connection *conns, int max);
+
 typedef struct lell_pcapng_handle lell_pcapng_handle;
 /* create a PCAPNG file for LE captures */
 int lell_pcapng_create_file(const char *filename, const char *interface_desc, lell_pcapng_handle ** ph);
@@ -0,0 +1,87 @@
+/* -*- c -*- */
+/*
+ * This file is part of libbtbb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libbtbb; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "packet_pool.h"
+
+typedef struct {
+	void *free[PACKET_POOLS][PACKET_POOL_DEPTH];
+	int count[PACKET_POOLS];
+} pool_cache;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static int cache_ok;
+
+/* release everything a thread had cached when it exits */
+static void cache_destroy(void *arg)
+{
+	pool_cache *cache = (pool_cache *) arg;
+	int pool, i;
+
+	for (pool = 0; pool < PACKET_POOLS; pool++)
+		for (i = 0; i < cache->count[pool]; i++)
+			free(cache->free[pool][i]);
+	free(cache);
+}
+
+static void cache_init(void)
+{
+	cache_ok = (pthread_key_create(&cache_key, cache_destroy) == 0);
+}
+
+static pool_cache *thread_cache(int create)
+{
+	pool_cache *cache;
+
+	pthread_once(&cache_once, cache_init);
+	if (!cache_ok)
+		return NULL;
+	cache = (pool_cache *) pthread_getspecific(cache_key);
+	if (!cache && create) {
+		cache = (pool_cache *) calloc(1, sizeof(pool_cache));
+		if (cache && pthread_setspecific(cache_key, cache)) {
+			free(cache);
+			cache = NULL;
+		}
+	}
+	return cache;
+}
+
+void *packet_pool_get(int pool)
+{
+	pool_cache *cache = thread_cache(0);
+
+	if (!cache || cache->count[pool] == 0)
+		return NULL;
+	return cache->free[pool][--cache->count[pool]];
+}
+
+int packet_pool_put(int pool, void *pkt)
+{
+	pool_cache *cache = thread_cache(1);
+
+	if (!cache || cache->count[pool] == PACKET_POOL_DEPTH)
+		return 0;
+	cache->free[pool][cache->count[pool]++] = pkt;
+	return 1;
+}
@@ -0,0 +1,40 @@
+/* -*- c -*- */
+/*
+ * This file is part of libbtbb
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libbtbb; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef INCLUDED_PACKET_POOL_H
+#define INCLUDED_PACKET_POOL_H
+
+/* Per-thread caches of released packets, so that steady-state capture
+ * reuses packets instead of going back to the heap for each one. */
+
+#define PACKET_POOL_BTBB 0
+#define PACKET_POOL_LELL 1
+#define PACKET_POOLS 2
+
+/* packets kept per pool per thread */
+#define PACKET_POOL_DEPTH 32
+
+/* take a packet from this thread's cache, NULL if it is empty */
+void *packet_pool_get(int pool);
+
+/* give a packet to this thread's cache, returns 0 if the cache is full
+ * and the caller should free it instead */
+int packet_pool_put(int pool, void *pkt);
+
+#endif /* INCLUDED_PACKET_POOL_H */
@@ -88,6 +88,7 @@ static void usage(void)
 	printf("    Data source:\n");
 	printf("\t-i<filename> read packets from file\n");
 	printf("\t-U<0-7> set ubertooth device to use\n");
+	printf("\t-P poll for packets instead of streaming them\n");
 	printf("\n");
 	printf("    Misc:\n");
 	printf("\t-r<filename> capture packets to PCAPNG file\n");
@@ -99,14 +100,46 @@ static void usage(void)
 	printf("\t-A<index> advertising channel index (default 37)\n");
 	printf("\t-v[01] verify CRC mode, get status or enable/disable\n");
         printf("\t-x<n> allow n access address offenses (default 32)\n");
+	printf("\t-m<us> minimum wait between polls (default %d)\n", poll_min_interval_us);
+	printf("\t-M<us> maximum wait between polls (default %d)\n", poll_max_interval_us);
+	printf("\t-S print poll statistics every second\n");
 
 	printf("\nIf an input file is not specified, an Ubertooth device is used for live capture.\n");
 	printf("In get/set mode no capture occurs.\n");
 }
 
+/* connections seen while following or sniffing */
+static lell_tracker *tracker = NULL;
+#define TRACKED_CONNECTIONS 64
+
+static void print_connections(void)
+{
+	lell_connection conns[TRACKED_CONNECTIONS];
+	int i, n;
+
+	if (!tracker)
+		return;
+	n = lell_tracker_live(tracker, UINT32_MAX, conns, TRACKED_CONNECTIONS);
+	for (i = 0; i < n; i++) {
+		printf("Connection AA %08x: %u packets", conns[i].access_address,
+		       conns[i].packets);
+		if (conns[i].params_known)
+			printf(", CRCInit %06x, interval %.2f ms, hop %u",
+			       conns[i].crc_init, conns[i].interval * 1.25,
+			       conns[i].hop_increment);
+		printf("\n");
+	}
+}
+
 void cleanup(int sig)
 {
-	sig = sig;
+	/* While streaming, only ask rx_btle()/poll_btle() to return: main()
+	 * prints the connections once they have, since the tracker lock may
+	 * be held by the thread we interrupted. */
+	if (tracker) {
+		stop_transfers(sig);
+		return;
+	}
 	if (devh) {
 		ubertooth_stop(devh);
 	}
@@ -122,6 +155,7 @@ int main(int argc, char *argv[])
 	int do_adv_index;
 	int do_slave_mode;
 	int do_target;
+	int do_poll;
 	char ubertooth_device = -1;
 
 	btle_options cb_opts = { .allowed_access_address_errors = 32 };
@@ -134,9 +168,10 @@ int main(int argc, char *argv[])
 	do_get_aa = do_set_aa = 0;
 	do_crc = -1; // 0 and 1 mean set, 2 means get
 	do_adv_index = 37;
+	do_poll = 0;
 	do_slave_mode = do_target = 0;
 
-	while ((opt=getopt(argc,argv,"a::r:d:hfpi:U:v::A:s:t:x:c:q:")) != EOF) {
+	while ((opt=getopt(argc,argv,"a::r:d:hfpi:U:v::A:s:t:x:c:q:Pm:M:S")) != EOF) {
 		switch(opt) {
 		case 'a':
 			if (optarg == NULL) {
@@ -241,6 +276,18 @@ int main(int argc, char *argv[])
 				return 1;
 			}
 			break;
+		case 'P':
+			do_poll = 1;
+			break;
+		case 'm':
+			poll_min_interval_us = atoi(optarg);
+			break;
+		case 'M':
+			poll_max_interval_us = atoi(optarg);
+			break;
+		case 'S':
+			poll_stats = 1;
+			break;
 		case 'h':
 		default:
 			__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "No parameter found");
@@ -271,8 +318,6 @@ int main(int argc, char *argv[])
 
 
 	if (do_follow || do_promisc) {
-		usb_pkt_rx pkt;
-
 		cmd_set_modulation(devh, MOD_BT_LOW_ENERGY);
 
 		if (do_follow) {
@@ -289,17 +334,17 @@ int main(int argc, char *argv[])
 			cmd_btle_promisc(devh);
 		}
 
-		while (1) {
-			int r = cmd_poll(devh, &pkt);
-			if (r < 0) {
-				printf("USB error\n");
-				break;
-			}
-			if (r == sizeof(usb_pkt_rx))
-				cb_btle(&cb_opts, &pkt, 0);
-			usleep(500);
-		}
+		tracker = lell_tracker_new(TRACKED_CONNECTIONS);
+		cb_opts.tracker = tracker;
+
+		if (do_poll)
+			r = poll_btle(devh, &cb_opts);
+		else
+			r = rx_btle(devh, &cb_opts);
+		if (r < 0)
+			printf("USB error\n");
 		ubertooth_stop(devh);
+		print_connections();
 	}
 
 	if (do_get_aa) {
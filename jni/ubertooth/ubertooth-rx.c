@@ -29,7 +29,11 @@ extern FILE *dumpfile;
 extern FILE *infile;
 extern int max_ac_errors;
 
+/* default -M: a few sequences (128 MB each) and their indexes (8 MB each) */
+#define DEFAULT_HOP_CACHE_MB 512
+
 struct libusb_device_handle *devh = NULL;
+static volatile sig_atomic_t capturing = 0;
 
 static void usage()
 {
@@ -46,13 +50,31 @@ static void usage()
 #endif
 	printf("\t-d<filename> dump packets to binary file\n");
 	printf("\t-e max_ac_errors (default: %d, range: 0-4)\n", max_ac_errors);
+	printf("\t-Y<filename> map the syndrome table from file (created if missing)\n");
+	printf("\t-L start capture before syndromes for more than 2 errors are ready\n");
+	printf("\t-v print syndrome table size and lookup latency per error level\n");
 	printf("\t-s reset channel scanning\n");
+	printf("\t-X<n> USB transfers kept in flight (default: %d, range: 1-%d)\n",
+	       DEFAULT_RX_XFERS, MAX_RX_XFERS);
+	printf("\t-b<0-2> when decoding falls behind: 0 drop newest (default), 1 drop oldest, 2 block\n");
+	printf("\t-P keep received symbols bit-packed while searching\n");
+	printf("\t-B benchmark the access code search implementations on the input file\n");
+	printf("\t-F generate the full hopping sequence (128 MB) for hop reversal\n");
+	printf("\t-H<dir> keep full hopping sequences in dir for reuse (implies -F)\n");
+	printf("\t-M<MB> limit the files kept by -H to MB in total (default: %d, 0: no limit)\n",
+	       DEFAULT_HOP_CACHE_MB);
 	printf("\nIf an input file is not specified, an Ubertooth device is used for live capture.\n");
 }
 
 void cleanup(int sig)
 {
-	sig = sig;
+	/* While capturing, only ask stream_rx_usb() to return: main() prints
+	 * the ring stats and stops the device once it has, and the event
+	 * thread and workers are still using both here. */
+	if (capturing) {
+		stop_transfers(sig);
+		return;
+	}
 	if (devh) {
 		ubertooth_stop(devh);
 	}
@@ -61,15 +83,20 @@ void cleanup(int sig)
 
 int main(int argc, char *argv[])
 {
-	int opt, have_lap = 0, have_uap = 0;
+	int opt, r, have_lap = 0, have_uap = 0;
 	int reset_scan = 0;
+	int benchmark = 0;
+	int verbose = 0;
+	char *hop_cache = NULL;
+	uint64_t hop_cache_mb = DEFAULT_HOP_CACHE_MB;
+	int have_cache_mb = 0;
 	char *end;
 	char ubertooth_device = -1;
 	btbb_piconet *pn = NULL;
 	uint32_t lap = 0;
 	uint8_t uap = 0;
 
-	while ((opt=getopt(argc,argv,"hi:l:u:U:d:e:r:sq:")) != EOF) {
+	while ((opt=getopt(argc,argv,"hi:l:u:U:d:e:r:sq:X:b:PY:LBvFH:M:")) != EOF) {
 		switch(opt) {
 		case 'i':
 			infile = fopen(optarg, "r");
@@ -125,6 +152,47 @@ int main(int argc, char *argv[])
 		case 's':
 			++reset_scan;
 			break;
+		case 'X':
+			rx_xfer_count = atoi(optarg);
+			if (rx_xfer_count < 1 || rx_xfer_count > MAX_RX_XFERS) {
+				printf("Error: transfers in flight must be 1-%d\n", MAX_RX_XFERS);
+				usage();
+				return 1;
+			}
+			break;
+		case 'b':
+			rx_backpressure = atoi(optarg);
+			if (rx_backpressure < RX_DROP_NEWEST || rx_backpressure > RX_BLOCK) {
+				printf("Error: unknown backpressure policy\n");
+				usage();
+				return 1;
+			}
+			break;
+		case 'P':
+			packed_symbols = 1;
+			break;
+		case 'Y':
+			btbb_set_syndrome_file(optarg);
+			break;
+		case 'L':
+			btbb_set_syndrome_lazy(1);
+			break;
+		case 'B':
+			benchmark = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'F':
+			btbb_set_hop_sequence(BTBB_HOP_SEQUENCE_FULL);
+			break;
+		case 'H':
+			hop_cache = optarg;
+			break;
+		case 'M':
+			hop_cache_mb = strtoull(optarg, &end, 10);
+			have_cache_mb++;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -132,6 +200,34 @@ int main(int argc, char *argv[])
 		}
 	}
 	
+	/* the cache only holds full sequences */
+	if (hop_cache) {
+		btbb_set_hop_sequence(BTBB_HOP_SEQUENCE_FULL);
+		btbb_set_hop_cache(hop_cache, hop_cache_mb << 20);
+	} else if (have_cache_mb) {
+		printf("Error: cache size but no cache directory specified\n");
+		usage();
+		return 1;
+	}
+
+	/* btbb_init() keeps the table built here, so capture reuses it */
+	if (verbose) {
+		if (btbb_init(max_ac_errors) < 0)
+			return 1;
+		btbb_print_syndrome_stats(stderr);
+	}
+
+	if (benchmark) {
+		if (infile == NULL) {
+			printf("Error: benchmark needs an input file (-i)\n");
+			usage();
+			return 1;
+		}
+		r = rx_search_benchmark(infile);
+		fclose(infile);
+		return r < 0 ? 1 : 0;
+	}
+
 	if (have_lap) {
 		pn = btbb_piconet_new();
 		btbb_init_piconet(pn, lap);
@@ -167,12 +263,15 @@ int main(int argc, char *argv[])
 		signal(SIGQUIT,cleanup);
 		signal(SIGTERM,cleanup);
 
+		capturing = 1;
 		rx_live(devh, pn, 0);
+		capturing = 0;
 
 		// Print AFH map from piconet if we have one
 		if (pn)
 			btbb_print_afh_map(pn);
 
+		print_rx_ring_stats(stderr);
 		ubertooth_stop(devh);
 	} else {
 		rx_file(infile, pn);
@@ -22,29 +22,121 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/time.h>
 #include "ubertooth.h"
 #include <android/log.h>
 
 /* this stuff should probably be in a struct managed by the calling program */
 static usb_pkt_rx usb_packets[NUM_BANKS];
 static char br_symbols[NUM_BANKS][BANK_LEN];
-static u8 *empty_usb_buf = NULL;
-static u8 *full_usb_buf = NULL;
-static u8 usb_really_full = 0;
-static struct libusb_transfer *rx_xfer = NULL;
+/* All banks of symbols, packed one per bit, plus a word of padding */
+static uint64_t br_packed[(NUM_BANKS * BANK_LEN + 63) / 64 + 1];
 static char Quiet = false;
 static uint32_t systime;
-static u8 usb_retry = 1;
-static u8 stop_ubertooth = 0;
+/* cleared by the consumer to stop resubmission; read by the event thread */
+static int usb_retry = 1;
+static volatile u8 stop_ubertooth = 0;
 static uint64_t abs_start_ns;
 static uint32_t start_clk100ns = 0;
 static uint64_t last_clk100ns = 0;
 static uint64_t clk100ns_upper = 0;
 
+/* Receive ring: rx_xfer_count bulk transfers are kept in flight at all
+ * times. Each has its own buffer, and there is an equal number of spare
+ * buffers. A completed transfer hands its buffer to the completed queue
+ * and is resubmitted straight away with a spare one, so the device
+ * always has somewhere to put data while the callback is busy. What
+ * happens when no spare buffer is left is decided by rx_backpressure.
+ *
+ * The completed queue and the free buffer queue are lock-free
+ * single-producer/single-consumer rings, so the libusb callback and the
+ * decoding loop may run on different threads. The only twist is that
+ * pop is a compare-and-swap on head, which lets the producer discard
+ * the oldest completed block under RX_DROP_OLDEST. */
+typedef struct {
+	u8 *buf;
+	int slot;
+} rx_block;
+
+#define RX_QUEUE_LEN (2 * MAX_RX_XFERS)
+
+typedef struct {
+	rx_block entries[RX_QUEUE_LEN];
+	unsigned head; /* next entry to consume */
+	unsigned tail; /* next entry to fill */
+} rx_queue;
+
+static void rx_queue_init(rx_queue *q)
+{
+	__atomic_store_n(&q->head, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->tail, 0, __ATOMIC_RELEASE);
+}
+
+/* producer side only */
+static int rx_queue_push(rx_queue *q, u8 *buf, int slot)
+{
+	unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= RX_QUEUE_LEN)
+		return 0;
+	q->entries[tail % RX_QUEUE_LEN].buf = buf;
+	q->entries[tail % RX_QUEUE_LEN].slot = slot;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int rx_queue_pop(rx_queue *q, rx_block *block)
+{
+	unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	do {
+		if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+			return 0;
+		*block = q->entries[head % RX_QUEUE_LEN];
+	} while (!__atomic_compare_exchange_n(&q->head, &head, head + 1, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return 1;
+}
+
+static struct libusb_transfer *rx_xfers[MAX_RX_XFERS];
+static u8 rx_xfer_live[MAX_RX_XFERS];
+static int rx_xfers_active = 0;
+static u8 *rx_buf_pool = NULL;
+static rx_queue rx_completed;
+static rx_queue rx_free[MAX_RX_WORKERS]; /* one return queue per worker */
+static int rx_num_workers = 1;
+static pthread_t rx_consumer;
+static rx_ring_stats ring_stats;
+static volatile int rx_seen_data = 0;
+/* LE traffic is bursty: once the bulk endpoint has delivered a packet, a
+ * timed out transfer only means the air was quiet, so resubmit it */
+static int rx_resubmit_timeouts = 0;
+
+/* Streaming engine state shared by the event thread and the workers */
+static volatile int rx_running = 0;
+static volatile int rx_events_running = 0;
+static int rx_threaded = 0;
+static sem_t rx_ready; /* posted for every completed block */
+static int rx_ready_created = 0; /* rx_ready needs sem_destroy() */
+
+int rx_xfer_count = DEFAULT_RX_XFERS;
+int rx_backpressure = RX_DROP_NEWEST;
+int rx_block_timeout_ms = 100;
+int rx_event_thread = 1;
+int rx_workers = 1;
+int packed_symbols = 0;
+int poll_min_interval_us = 100;
+int poll_max_interval_us = 8000;
+int poll_stats = 0;
+
 FILE *infile = NULL;
 FILE *dumpfile = NULL;
 int max_ac_errors = 2;
@@ -58,6 +150,8 @@ lell_pcapng_handle * h_pcapng_le = NULL;
 //define logging stuff
 #define LOG_TAG "Ubertooth_Cfile_Log" // text for log tag
 
+/* Ask stream_rx_usb() or poll_btle() to return. Safe to call from a signal handler or
+ * from another thread. */
 void stop_transfers(int sig) {
 	sig = sig; // Unused parameter
 	stop_ubertooth = 1;
@@ -164,35 +258,122 @@ static void rx_xfer_status(int status)
 	fprintf(stderr,"rx_xfer status: %s (%d)\n",error_name,status);
 }
 
+static uint64_t now_ns( void );
+
+/* Take a spare buffer from whichever worker has one to give back */
+static int rx_take_free(rx_block *block)
+{
+	static int next = 0;
+	int i;
+
+	for (i = 0; i < rx_num_workers; i++) {
+		next = (next + 1) % rx_num_workers;
+		if (rx_queue_pop(&rx_free[next], block))
+			return 1;
+	}
+	return 0;
+}
+
+static void rx_hand_over(u8 *buf, int slot)
+{
+	rx_queue_push(&rx_completed, buf, slot);
+	if (rx_threaded)
+		sem_post(&rx_ready);
+}
+
+/* The consumer is behind and there is no spare buffer for this
+ * transfer. Decide, according to rx_backpressure, whose data is lost
+ * and leave xfer->buffer pointing at a buffer it may be resubmitted
+ * with. */
+static void rx_backpressure_drop(struct libusb_transfer *xfer, int slot)
+{
+	rx_block spare;
+	uint64_t deadline;
+
+	switch (rx_backpressure) {
+	case RX_BLOCK:
+		/* Waiting only makes sense if somebody else is emptying
+		 * the queue, i.e. libusb events are not being handled on
+		 * the consumer thread. */
+		if (!pthread_equal(pthread_self(), rx_consumer)) {
+			ring_stats.block_waits++;
+			deadline = now_ns() + 1000000ull * rx_block_timeout_ms;
+			while (now_ns() < deadline && rx_running) {
+				if (rx_take_free(&spare)) {
+					rx_hand_over(xfer->buffer, slot);
+					xfer->buffer = spare.buf;
+					return;
+				}
+				sched_yield();
+			}
+		}
+		ring_stats.block_timeouts++;
+		break;
+	case RX_DROP_OLDEST:
+		if (rx_queue_pop(&rx_completed, &spare)) {
+			ring_stats.dropped_oldest++;
+			ring_stats.dropped[spare.slot]++;
+			rx_queue_push(&rx_completed, xfer->buffer, slot);
+			xfer->buffer = spare.buf;
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+
+	/* RX_DROP_NEWEST, or nothing better was possible: reuse the
+	 * buffer and lose the data just received */
+	ring_stats.dropped_newest++;
+	ring_stats.dropped[slot]++;
+}
+
+/* Transfers are only ever freed by rx_ring_teardown(), so that it can
+ * safely cancel a transfer the event thread is completing. */
+static void rx_xfer_retire(int slot)
+{
+	rx_xfer_live[slot] = 0;
+	__atomic_sub_fetch(&rx_xfers_active, 1, __ATOMIC_RELEASE);
+	if (rx_threaded)
+		sem_post(&rx_ready);
+}
+
 static void cb_xfer(struct libusb_transfer *xfer)
 {
 	int r;
-	uint8_t *tmp;
+	int slot = (int)(intptr_t)xfer->user_data;
+	rx_block spare;
 
+	if (xfer->status == LIBUSB_TRANSFER_TIMED_OUT && rx_resubmit_timeouts
+			&& rx_seen_data && __atomic_load_n(&usb_retry, __ATOMIC_ACQUIRE)) {
+		if (libusb_submit_transfer(xfer) == 0)
+			return;
+	}
 	if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		if(xfer->status != LIBUSB_TRANSFER_CANCELLED)
 			rx_xfer_status(xfer->status);
-		libusb_free_transfer(xfer);
-		rx_xfer = NULL;
+		rx_xfer_retire(slot);
 		return;
 	}
 
-	while (usb_really_full) {
-		fprintf(stderr, "uh oh, full_usb_buf not emptied\n");
+	ring_stats.completed[slot]++;
+	rx_seen_data = 1;
+	if (rx_take_free(&spare)) {
+		rx_hand_over(xfer->buffer, slot);
+		xfer->buffer = spare.buf;
+	} else {
+		rx_backpressure_drop(xfer, slot);
 	}
 
-	tmp = full_usb_buf;
-	full_usb_buf = empty_usb_buf;
-	empty_usb_buf = tmp;
-	usb_really_full = 1;
-	rx_xfer->buffer = empty_usb_buf;
+	if (!__atomic_load_n(&usb_retry, __ATOMIC_ACQUIRE)) {
+		rx_xfer_retire(slot);
+		return;
+	}
 
-	while (usb_retry) {
-		r = libusb_submit_transfer(rx_xfer);
-		if (r < 0)
-			fprintf(stderr, "rx_xfer submission from callback: %d\n", r);
-		else
-			break;
+	r = libusb_submit_transfer(xfer);
+	if (r < 0) {
+		fprintf(stderr, "rx_xfer submission from callback: %d\n", r);
+		rx_xfer_retire(slot);
 	}
 }
 
@@ -211,6 +392,158 @@ static inline int handle_events_wrapper() {
 	return 0;
 }
 
+/* Dedicated thread servicing libusb: it runs cb_xfer() and nothing
+ * else, so USB is never held up by decoding. */
+static void *rx_event_loop(void *arg)
+{
+	struct timeval tv;
+	int r;
+
+	UNUSED(arg);
+
+	while (rx_events_running) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		r = libusb_handle_events_timeout(NULL, &tv);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			show_libusb_error(r);
+			break;
+		}
+	}
+	rx_running = 0;
+	if (rx_threaded)
+		sem_post(&rx_ready);
+	return NULL;
+}
+
+typedef struct {
+	int id;
+	int xfer_blocks;
+	rx_callback cb;
+	void *cb_args;
+	int status;
+} rx_worker_args;
+
+/* Wait for the next completed block. Returns 0 once the stream is
+ * over, -1 if it ended because the USB side failed. */
+static int rx_next_block(rx_block *block)
+{
+	struct timespec ts;
+
+	while (!rx_queue_pop(&rx_completed, block)) {
+		if (stop_ubertooth)
+			rx_running = 0;
+		if (!rx_running)
+			return 0;
+		if (__atomic_load_n(&rx_xfers_active, __ATOMIC_ACQUIRE) == 0)
+			return -1;
+		if (rx_threaded) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			sem_timedwait(&rx_ready, &ts);
+		} else if (handle_events_wrapper() < 0) {
+			return -1;
+		}
+	}
+	return 1;
+}
+
+static void *rx_worker(void *arg)
+{
+	rx_worker_args *w = (rx_worker_args *) arg;
+	usb_pkt_rx* rx;
+	rx_block block;
+	uint8_t bank = 0;
+	int i;
+
+	w->status = 1;
+	while (rx_running) {
+		w->status = rx_next_block(&block);
+		if (w->status <= 0)
+			break;
+
+		/* process each received block */
+		for (i = 0; i < w->xfer_blocks; i++) {
+			rx = (usb_pkt_rx *)(block.buf + PKT_LEN * i);
+			if(rx->pkt_type != KEEP_ALIVE)
+				(*w->cb)(w->cb_args, rx, bank);
+			bank = (bank + 1) % NUM_BANKS;
+			if(stop_ubertooth) {
+				rx_running = 0;
+				break;
+			}
+		}
+		__atomic_add_fetch(&ring_stats.blocks, i, __ATOMIC_RELAXED);
+		rx_queue_push(&rx_free[w->id], block.buf, -1);
+		fflush(stderr);
+	}
+	if (w->status == 0)
+		w->status = 1;
+	rx_running = 0;
+	if (rx_threaded)
+		sem_post(&rx_ready);
+	return NULL;
+}
+
+/* Cancel every transfer still in flight and wait for the callbacks
+ * to release them, then give back the transfers and ring buffers. */
+static void rx_ring_teardown(pthread_t *event_thread)
+{
+	int i;
+
+	rx_running = 0;
+	__atomic_store_n(&usb_retry, 0, __ATOMIC_RELEASE);
+	for (i = 0; i < MAX_RX_XFERS; i++)
+		if (rx_xfers[i] != NULL && rx_xfer_live[i])
+			libusb_cancel_transfer(rx_xfers[i]);
+	while (__atomic_load_n(&rx_xfers_active, __ATOMIC_ACQUIRE) > 0) {
+		if (event_thread) {
+			if (!rx_events_running)
+				break;
+			usleep(1000);
+		} else if (handle_events_wrapper() < 0) {
+			break;
+		}
+	}
+	if (event_thread) {
+		rx_events_running = 0;
+		pthread_join(*event_thread, NULL);
+	}
+	__atomic_store_n(&usb_retry, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < MAX_RX_XFERS; i++) {
+		if (rx_xfers[i] != NULL)
+			libusb_free_transfer(rx_xfers[i]);
+		rx_xfers[i] = NULL;
+		rx_xfer_live[i] = 0;
+	}
+	rx_xfers_active = 0;
+	rx_queue_init(&rx_completed);
+	for (i = 0; i < MAX_RX_WORKERS; i++)
+		rx_queue_init(&rx_free[i]);
+	if (rx_ready_created)
+		sem_destroy(&rx_ready);
+	rx_ready_created = 0;
+	rx_threaded = 0;
+	free(rx_buf_pool);
+	rx_buf_pool = NULL;
+}
+
+/*
+ * Streaming receive engine. rx_xfer_count bulk transfers are kept in
+ * flight; if rx_event_thread is set, a dedicated thread services libusb
+ * while the calling thread (plus rx_workers - 1 extra threads) runs the
+ * callback on completed blocks. With more than one worker, blocks are
+ * no longer delivered in order and the callback must be reentrant, so
+ * the BR/EDR and dump callbacks need rx_workers = 1.
+ *
+ * The caller puts the firmware into a mode that streams on the bulk
+ * endpoint (cmd_rx_syms(), cmd_btle_sniffing(), ...) beforehand.
+ */
 int stream_rx_usb(struct libusb_device_handle* devh, int xfer_size,
 		uint16_t num_blocks, rx_callback cb, void* cb_args)
 {
@@ -218,10 +551,10 @@ int stream_rx_usb(struct libusb_device_handle* devh, int xfer_size,
 	int i;
 	int xfer_blocks;
 	int num_xfers;
-	usb_pkt_rx* rx;
-	uint8_t bank = 0;
-	uint8_t rx_buf1[BUFFER_SIZE];
-	uint8_t rx_buf2[BUFFER_SIZE];
+	int ring_size;
+	pthread_t event_thread;
+	pthread_t worker_threads[MAX_RX_WORKERS];
+	rx_worker_args workers[MAX_RX_WORKERS];
 
 	/*
 	 * A block is 64 bytes transferred over USB (includes 50 bytes of rx symbol
@@ -236,49 +569,120 @@ int stream_rx_usb(struct libusb_device_handle* devh, int xfer_size,
 	num_xfers = num_blocks / xfer_blocks;
 	num_blocks = num_xfers * xfer_blocks;
 
+	ring_size = MIN(MAX(rx_xfer_count, 1), MAX_RX_XFERS);
+	rx_num_workers = MIN(MAX(rx_workers, 1), MAX_RX_WORKERS);
+	rx_threaded = (rx_event_thread != 0);
+	if (!rx_threaded)
+		rx_num_workers = 1;
+
 	/*
 	fprintf(stderr, "rx %d blocks of 64 bytes in %d byte transfers\n",
 		num_blocks, xfer_size);
 	*/
 
-	empty_usb_buf = &rx_buf1[0];
-	full_usb_buf = &rx_buf2[0];
-	usb_really_full = 0;
-	rx_xfer = libusb_alloc_transfer(0);
-	libusb_fill_bulk_transfer(rx_xfer, devh, DATA_IN, empty_usb_buf,
-			xfer_size, cb_xfer, NULL, TIMEOUT);
-
-	cmd_rx_syms(devh, num_blocks);
-
-	r = libusb_submit_transfer(rx_xfer);
-	if (r < 0) {
-		fprintf(stderr, "rx_xfer submission: %d\n", r);
+	rx_buf_pool = malloc(2 * ring_size * xfer_size);
+	if (rx_buf_pool == NULL) {
+		fprintf(stderr, "unable to allocate rx ring\n");
 		return -1;
 	}
-
-	while (1) {
-		while (!usb_really_full) {
-			handle_events_wrapper();
+	memset(&ring_stats, 0, sizeof(ring_stats));
+	ring_stats.num_xfers = ring_size;
+	rx_consumer = pthread_self();
+	rx_queue_init(&rx_completed);
+	for (i = 0; i < MAX_RX_WORKERS; i++)
+		rx_queue_init(&rx_free[i]);
+	for (i = 0; i < ring_size; i++)
+		rx_queue_push(&rx_free[0], rx_buf_pool + (ring_size + i) * xfer_size, -1);
+	if (rx_threaded) {
+		rx_ready_created = sem_init(&rx_ready, 0, 0) == 0;
+		if (!rx_ready_created) {
+			rx_threaded = 0;
+			rx_num_workers = 1;
+		}
+	}
+	rx_running = 1;
+	rx_seen_data = 0;
+
+	for (i = 0; i < ring_size; i++) {
+		rx_xfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(rx_xfers[i], devh, DATA_IN,
+				rx_buf_pool + i * xfer_size, xfer_size, cb_xfer,
+				(void *)(intptr_t)i, TIMEOUT);
+		rx_xfer_live[i] = 1;
+		__atomic_add_fetch(&rx_xfers_active, 1, __ATOMIC_RELEASE);
+		r = libusb_submit_transfer(rx_xfers[i]);
+		if (r < 0) {
+			fprintf(stderr, "rx_xfer submission: %d\n", r);
+			rx_xfer_live[i] = 0;
+			__atomic_sub_fetch(&rx_xfers_active, 1, __ATOMIC_RELEASE);
+			rx_ring_teardown(NULL);
+			return -1;
 		}
+	}
 
-		/* process each received block */
-		for (i = 0; i < xfer_blocks; i++) {
-			rx = (usb_pkt_rx *)(full_usb_buf + PKT_LEN * i);
-			if(rx->pkt_type != KEEP_ALIVE)
-				(*cb)(cb_args, rx, bank);
-			bank = (bank + 1) % NUM_BANKS;
-			if(stop_ubertooth) {
-				stop_ubertooth = 0;
-				usb_really_full = 0;
-				usb_retry = 0;
-				handle_events_wrapper();
-				usb_retry = 1;
-				return 1;
-			}
+	if (rx_threaded) {
+		rx_events_running = 1;
+		if (pthread_create(&event_thread, NULL, rx_event_loop, NULL) != 0) {
+			fprintf(stderr, "unable to start USB event thread\n");
+			rx_events_running = 0;
+			rx_threaded = 0;
+			rx_num_workers = 1;
 		}
-		usb_really_full = 0;
-		fflush(stderr);
 	}
+
+	for (i = 0; i < rx_num_workers; i++) {
+		workers[i].id = i;
+		workers[i].xfer_blocks = xfer_blocks;
+		workers[i].cb = cb;
+		workers[i].cb_args = cb_args;
+		workers[i].status = 1;
+	}
+	for (i = 1; i < rx_num_workers; i++)
+		if (pthread_create(&worker_threads[i], NULL, rx_worker, &workers[i]) != 0)
+			break;
+	r = i;
+
+	/* the calling thread is always worker 0 */
+	rx_worker(&workers[0]);
+
+	for (i = 1; i < r; i++)
+		pthread_join(worker_threads[i], NULL);
+	stop_ubertooth = 0;
+	rx_ring_teardown(rx_threaded ? &event_thread : NULL);
+
+	for (i = 0; i < r; i++)
+		if (workers[i].status < 0)
+			return -1;
+	return 1;
+}
+
+void get_rx_ring_stats(rx_ring_stats *stats)
+{
+	memcpy(stats, &ring_stats, sizeof(rx_ring_stats));
+}
+
+void print_rx_ring_stats(FILE *fp)
+{
+	int i;
+	u64 completed = 0, dropped = 0;
+
+	for (i = 0; i < ring_stats.num_xfers; i++) {
+		completed += ring_stats.completed[i];
+		dropped += ring_stats.dropped[i];
+	}
+	fprintf(fp, "rx ring: %d transfers, %llu blocks, %llu transfers completed, %llu dropped\n",
+		ring_stats.num_xfers, (unsigned long long)ring_stats.blocks,
+		(unsigned long long)completed, (unsigned long long)dropped);
+	fprintf(fp, "  backpressure: %llu newest dropped, %llu oldest dropped, %llu waits, %llu wait timeouts\n",
+		(unsigned long long)ring_stats.dropped_newest,
+		(unsigned long long)ring_stats.dropped_oldest,
+		(unsigned long long)ring_stats.block_waits,
+		(unsigned long long)ring_stats.block_timeouts);
+	for (i = 0; i < ring_stats.num_xfers; i++)
+		if (ring_stats.dropped[i])
+			fprintf(fp, "  slot %2d: %llu completed, %llu dropped\n", i,
+				(unsigned long long)ring_stats.completed[i],
+				(unsigned long long)ring_stats.dropped[i]);
 }
 
 /* file should be in full USB packet format (ubertooth-dump -f) */
@@ -322,6 +726,24 @@ static void unpack_symbols(uint8_t* buf, char* unpacked)
 	}
 }
 
+static inline uint8_t reverse_bits8(uint8_t b)
+{
+	b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+	b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+	return (b & 0xaa) >> 1 | (b & 0x55) << 1;
+}
+
+/* Pack received symbols (MSB first in each byte) into 'packed' at symbol
+ * 'offset', which must be a multiple of 8, as btbb_find_ac_packed()
+ * expects them. The destination bits must be clear. */
+static void pack_symbols(const uint8_t* buf, uint64_t* packed, int offset)
+{
+	int i;
+
+	for (i = 0; i < SYM_LEN; i++, offset += 8)
+		packed[offset >> 6] |= (uint64_t)reverse_bits8(buf[i]) << (offset & 63);
+}
+
 static int8_t cc2400_rssi_to_dbm( const int8_t rssi )
 {
 	/* models the cc2400 datasheet fig 22 for 1M as piece-wise linear */
@@ -442,7 +864,8 @@ static void cb_br_rx(void* args, usb_pkt_rx *rx, int bank)
 	/* Copy packet (for dump) */
 	memcpy(&usb_packets[bank], rx, sizeof(usb_pkt_rx));
 
-	unpack_symbols(rx->data, br_symbols[bank]);
+	if (!packed_symbols)
+		unpack_symbols(rx->data, br_symbols[bank]);
 
 	/* Do analysis based on oldest packet */
 	rx = &usb_packets[ (bank+1) % NUM_BANKS ];
@@ -454,13 +877,6 @@ static void cb_br_rx(void* args, usb_pkt_rx *rx, int bank)
 	/* WC4: use vm circbuf if target allows. This gets rid of this
 	 * wrapped copy step. */
 
-	/* Copy 2 oldest banks of symbols for analysis. Packet may
-	 * cross a bank boundary. */
-	for (i = 0; i < 2; i++)
-		memcpy(syms + i * BANK_LEN,
-		       br_symbols[(i + 1 + bank) % NUM_BANKS],
-		       BANK_LEN);
-
 	/* Look for packets with specified LAP, if given. Otherwise
 	 * search for any packet.  Also determine if UAP is known. */
 	if (pn) {
@@ -468,6 +884,40 @@ static void cb_br_rx(void* args, usb_pkt_rx *rx, int bank)
 		uap = btbb_piconet_get_flag(pn, BTBB_UAP_VALID) ? btbb_piconet_get_uap(pn) : UAP_ANY;
 	}
 
+	/* Packed path: symbols stay 8 to a byte (one per bit once
+	 * packed) and are repacked straight from the saved USB packets,
+	 * so br_symbols and syms are not touched at all. */
+	if (packed_symbols) {
+		/* Pack 2 oldest banks for analysis. Packet may cross a
+		 * bank boundary. */
+		memset(br_packed, 0, sizeof(br_packed));
+		for (i = 0; i < 2; i++)
+			pack_symbols(usb_packets[(i + 1 + bank) % NUM_BANKS].data,
+				     br_packed, i * BANK_LEN);
+
+		offset = btbb_find_ac_packed(br_packed, BANK_LEN, lap,
+					     max_ac_errors, &pkt);
+		if (offset < 0)
+			goto out;
+
+		for (i = 2; i < NUM_BANKS; i++)
+			pack_symbols(usb_packets[(i + 1 + bank) % NUM_BANKS].data,
+				     br_packed, i * BANK_LEN);
+
+		clkn = (rx->clkn_high << 20) + (letoh32(rx->clk100ns) + offset + 1562) / 3125;
+		btbb_packet_set_data_packed(pkt, br_packed, offset,
+					    NUM_BANKS * BANK_LEN - offset,
+					    rx->channel, clkn);
+		goto found;
+	}
+
+	/* Copy 2 oldest banks of symbols for analysis. Packet may
+	 * cross a bank boundary. */
+	for (i = 0; i < 2; i++)
+		memcpy(syms + i * BANK_LEN,
+		       br_symbols[(i + 1 + bank) % NUM_BANKS],
+		       BANK_LEN);
+
 	/* Pass packet-pointer-pointer so that
 	 * packet can be created in libbtbb. */
 	offset = btbb_find_ac(syms, BANK_LEN, lap, max_ac_errors, &pkt);
@@ -487,6 +937,8 @@ static void cb_br_rx(void* args, usb_pkt_rx *rx, int bank)
 	btbb_packet_set_data(pkt, syms + offset, NUM_BANKS * BANK_LEN - offset,
 			   rx->channel, clkn);
 
+found:
+
 	/* Dump to PCAP/PCAPNG if specified */
 #if defined(USE_PCAP)
         if (h_pcap_bredr) {
@@ -561,6 +1013,7 @@ void rx_live(struct libusb_device_handle* devh, btbb_piconet* pn, int timeout)
 	if (follow_pn)
 		cmd_set_clock(devh, 0);
 	else {
+		cmd_rx_syms(devh, 0);
 		stream_rx_usb(devh, XFER_LEN, 0, cb_br_rx, pn);
 		/* Allow pending transfers to finish */
 		sleep(1);
@@ -572,6 +1025,7 @@ void rx_live(struct libusb_device_handle* devh, btbb_piconet* pn, int timeout)
 		cmd_stop(devh);
 		cmd_set_bdaddr(devh, btbb_piconet_get_bdaddr(follow_pn));
 		cmd_start_hopping(devh, btbb_piconet_get_clk_offset(follow_pn));
+		cmd_rx_syms(devh, 0);
 		stream_rx_usb(devh, XFER_LEN, 0, cb_br_rx, follow_pn);
 	}
 }
@@ -585,6 +1039,139 @@ void rx_file(FILE* fp, btbb_piconet* pn)
 	stream_rx_file(fp, 0, cb_br_rx, pn);
 }
 
+/* USB packets read by rx_search_benchmark() */
+typedef struct {
+	usb_pkt_rx *pkts;
+	int count;
+	int size;
+} bench_capture;
+
+static void cb_bench_collect(void* args, usb_pkt_rx *rx, int bank)
+{
+	bench_capture *cap = (bench_capture *)args;
+	usb_pkt_rx *pkts;
+
+	UNUSED(bank);
+	if (cap->count == cap->size) {
+		pkts = realloc(cap->pkts, (cap->size * 2 + 1024) * sizeof(usb_pkt_rx));
+		if (pkts == NULL)
+			return;
+		cap->pkts = pkts;
+		cap->size = cap->size * 2 + 1024;
+	}
+	cap->pkts[cap->count++] = *rx;
+}
+
+/* Ways of searching for LAP_ANY that rx_search_benchmark() compares */
+#define BENCH_UNPACKED   0 /* btbb_find_ac() on one symbol per char */
+#define BENCH_SCALAR     1 /* btbb_find_ac_packed(), one offset at a time */
+#define BENCH_BITSLICED  2 /* btbb_find_ac_packed(), 64 offsets at a time */
+#define BENCH_MODES      3
+
+/* Time the promiscuous access code search over every pair of adjacent
+ * banks in a dump file, as cb_br_rx() searches them, with each search
+ * implementation, and check that they find the same packets. Returns -1
+ * if the benchmark could not run. */
+int rx_search_benchmark(FILE* fp)
+{
+	static const char *names[BENCH_MODES] = {
+		"unpacked", "packed scalar", "packed bit-sliced"
+	};
+	bench_capture cap = { NULL, 0, 0 };
+	btbb_packet *pkt = NULL;
+	char *syms = NULL;
+	uint64_t *packed = NULL;
+	int *offsets[BENCH_MODES] = { NULL };
+	uint32_t *laps[BENCH_MODES] = { NULL };
+	int mode, i, j, windows, found, differ, r = -1;
+	uint64_t start, mode_ns[BENCH_MODES];
+	uint8_t buf[SYM_LEN];
+	/* two banks of packed symbols, and the padding btbb_find_ac_packed() reads */
+	const int packed_words = (2 * BANK_LEN + 63) / 64 + 2;
+
+	if (btbb_init(max_ac_errors) < 0)
+		return -1;
+	stream_rx_file(fp, 0, cb_bench_collect, &cap);
+	windows = cap.count - 1;
+	if (windows < 1) {
+		fprintf(stderr, "benchmark: need at least 2 USB packets in the file\n");
+		goto out;
+	}
+
+	/* lay out every window ahead of time, so only searches are timed */
+	syms = malloc((size_t)windows * 2 * BANK_LEN);
+	packed = calloc((size_t)windows * packed_words, sizeof(uint64_t));
+	if (!syms || !packed)
+		goto oom;
+	for (mode = 0; mode < BENCH_MODES; mode++) {
+		offsets[mode] = malloc(windows * sizeof(int));
+		laps[mode] = malloc(windows * sizeof(uint32_t));
+		if (!offsets[mode] || !laps[mode])
+			goto oom;
+	}
+	for (i = 0; i < windows; i++) {
+		for (j = 0; j < 2; j++) {
+			/* unpack_symbols() consumes its input */
+			memcpy(buf, cap.pkts[i + j].data, SYM_LEN);
+			unpack_symbols(buf, syms + ((size_t)i * 2 + j) * BANK_LEN);
+			pack_symbols(cap.pkts[i + j].data,
+				     packed + (size_t)i * packed_words, j * BANK_LEN);
+		}
+	}
+
+	printf("Access code search over %d windows of %d symbols, max_ac_errors %d\n",
+	       windows, BANK_LEN, max_ac_errors);
+	for (mode = 0; mode < BENCH_MODES; mode++) {
+		if (mode != BENCH_UNPACKED)
+			btbb_set_promisc_search(mode == BENCH_SCALAR ?
+						BTBB_PROMISC_SEARCH_SCALAR :
+						BTBB_PROMISC_SEARCH_BITSLICED);
+		found = 0;
+		start = now_ns();
+		for (i = 0; i < windows; i++) {
+			if (mode == BENCH_UNPACKED)
+				offsets[mode][i] = btbb_find_ac(syms + (size_t)i * 2 * BANK_LEN,
+								BANK_LEN, LAP_ANY,
+								max_ac_errors, &pkt);
+			else
+				offsets[mode][i] = btbb_find_ac_packed(packed + (size_t)i * packed_words,
+								       BANK_LEN, LAP_ANY,
+								       max_ac_errors, &pkt);
+			laps[mode][i] = offsets[mode][i] >= 0 ? btbb_packet_get_lap(pkt) : 0;
+			found += offsets[mode][i] >= 0;
+		}
+		mode_ns[mode] = now_ns() - start;
+
+		differ = 0;
+		for (i = 0; i < windows; i++)
+			differ += offsets[mode][i] != offsets[BENCH_UNPACKED][i]
+				|| laps[mode][i] != laps[BENCH_UNPACKED][i];
+		printf("  %-18s %8d found %10.1f ns/window %6.2fx",
+		       names[mode], found, (double)mode_ns[mode] / windows,
+		       (double)mode_ns[BENCH_UNPACKED] / (mode_ns[mode] ? mode_ns[mode] : 1));
+		if (differ)
+			printf("  %d windows differ from unpacked!", differ);
+		printf("\n");
+	}
+	btbb_set_promisc_search(BTBB_PROMISC_SEARCH_BITSLICED);
+	r = 0;
+	goto out;
+
+oom:
+	fprintf(stderr, "benchmark: out of memory\n");
+out:
+	if (pkt)
+		btbb_packet_unref(pkt);
+	for (mode = 0; mode < BENCH_MODES; mode++) {
+		free(offsets[mode]);
+		free(laps[mode]);
+	}
+	free(packed);
+	free(syms);
+	free(cap.pkts);
+	return r;
+}
+
 /*
  * Sniff Bluetooth Low Energy packets.
  */
@@ -607,6 +1194,10 @@ void cb_btle(void* args, usb_pkt_rx *rx, int bank)
 	if (rx->channel > (NUM_BREDR_CHANNELS-1))
 		return;
 
+	/* promiscuous mode status messages are not air packets */
+	if (rx->pkt_type == LE_PROMISC)
+		return;
+
 	if (infile == NULL)
 		systime = time(NULL);
 
@@ -617,15 +1208,16 @@ void cb_btle(void* args, usb_pkt_rx *rx, int bank)
 		if (fwrite(rx, sizeof(usb_pkt_rx), 1, dumpfile) != 1) {;}
 	}
 
-	lell_allocate_and_decode(rx->data, rx->channel + 2402, rx->clk100ns, &pkt);
-
 	/* do nothing further if filtered due to bad AA */
 	if (opts &&
 	    (opts->allowed_access_address_errors <
-	     lell_get_access_address_offenses(pkt))) {
-		lell_packet_unref(pkt);
+	     lell_stream_aa_offenses(rx->data, rx->channel + 2402)))
 		return;
-	}
+
+	lell_allocate_and_decode(rx->data, rx->channel + 2402, rx->clk100ns, &pkt);
+
+	if (opts && opts->tracker)
+		lell_tracker_update(opts->tracker, pkt);
 
 	/* Dump to PCAP/PCAPNG if specified */
 	refAA = lell_packet_is_data(pkt) ? 0 : 0x8e89bed6;
@@ -717,9 +1309,75 @@ static void cb_dump_full(void* args, usb_pkt_rx *rx, int bank)
 	}
 }
 
+/* Read LE packets one at a time over the control endpoint, for
+ * firmware that does not stream them on the bulk endpoint. The wait
+ * between polls doubles after every empty poll, up to
+ * poll_max_interval_us, and drops back to poll_min_interval_us as soon
+ * as a packet is returned, since more are likely to be queued. */
+int poll_btle(struct libusb_device_handle* devh, btle_options* opts)
+{
+	usb_pkt_rx pkt;
+	int r;
+	int min_us, max_us, interval;
+	u32 polls = 0, packets = 0;
+	uint64_t next_report;
+
+	min_us = MAX(poll_min_interval_us, 0);
+	max_us = MAX(poll_max_interval_us, min_us);
+	interval = min_us;
+	next_report = now_ns() + 1000000000ull;
+
+	while (!stop_ubertooth) {
+		r = cmd_poll(devh, &pkt);
+		if (r < 0) {
+			fprintf(stderr, "USB error\n");
+			stop_ubertooth = 0;
+			return -1;
+		}
+		polls++;
+		if (r == sizeof(usb_pkt_rx)) {
+			packets++;
+			cb_btle(opts, &pkt, 0);
+			interval = min_us;
+		} else {
+			interval = MIN(MAX(interval * 2, 1), max_us);
+		}
+
+		if (poll_stats && now_ns() >= next_report) {
+			fprintf(stderr, "poll: %u polls, %u packets, interval %d us\n",
+				polls, packets, interval);
+			polls = packets = 0;
+			next_report += 1000000000ull;
+		}
+		if (interval > 0)
+			usleep(interval);
+	}
+	stop_ubertooth = 0;
+	return 1;
+}
+
+/* Receive LE packets once cmd_btle_sniffing() or cmd_btle_promisc() has
+ * been issued. Packets are taken from the bulk endpoint one per transfer
+ * so that none waits for the rest of a transfer to fill; if the firmware
+ * never delivers anything there, fall back to polling. */
+int rx_btle(struct libusb_device_handle* devh, btle_options* opts)
+{
+	int r;
+
+	rx_resubmit_timeouts = 1;
+	r = stream_rx_usb(devh, PKT_LEN, 0, cb_btle, opts);
+	rx_resubmit_timeouts = 0;
+	if (r < 0 && !rx_seen_data) {
+		fprintf(stderr, "no LE packets on the bulk endpoint, polling instead\n");
+		r = poll_btle(devh, opts);
+	}
+	return r;
+}
+
 /* dump received symbols to stdout */
 void rx_dump(struct libusb_device_handle* devh, int bitstream)
 {
+	cmd_rx_syms(devh, 0);
 	if (bitstream)
 		stream_rx_usb(devh, XFER_LEN, 0, cb_dump_bitstream, NULL);
 	else
@@ -800,9 +1458,12 @@ int do_specan(struct libusb_device_handle* devh, int xfer_size, u16 num_blocks,
 
 void ubertooth_stop(struct libusb_device_handle *devh)
 {
+	int i;
+
 	/* make sure xfers are not active */
-	if(rx_xfer != NULL)
-		libusb_cancel_transfer(rx_xfer);
+	for (i = 0; i < MAX_RX_XFERS; i++)
+		if(rx_xfers[i] != NULL && rx_xfer_live[i])
+			libusb_cancel_transfer(rx_xfers[i]);
 	if (devh != NULL) {
 		cmd_stop(devh);
 		libusb_release_interface(devh, 0);
@@ -43,8 +43,50 @@ enum board_ids {
 
 typedef void (*rx_callback)(void* args, usb_pkt_rx *rx, int bank);
 
+/* Number of bulk transfers stream_rx_usb() keeps in flight */
+#define MAX_RX_XFERS     32
+#define DEFAULT_RX_XFERS 8
+
+/* Maximum number of threads running the rx_callback */
+#define MAX_RX_WORKERS   8
+
+/* What the USB callback does when the consumer has no free buffer left */
+enum rx_backpressure_policy {
+	RX_DROP_NEWEST = 0, /* lose the transfer that just completed */
+	RX_DROP_OLDEST = 1, /* lose the oldest transfer not yet consumed */
+	RX_BLOCK       = 2, /* wait up to rx_block_timeout_ms, then drop newest */
+};
+
+typedef struct {
+	int num_xfers;
+	u64 blocks;                      /* blocks handed to the callback */
+	u64 completed[MAX_RX_XFERS];     /* transfers completed, per ring slot */
+	u64 dropped[MAX_RX_XFERS];       /* transfers lost for want of a free buffer */
+	u64 dropped_newest;
+	u64 dropped_oldest;
+	u64 block_waits;                 /* RX_BLOCK waits started */
+	u64 block_timeouts;              /* RX_BLOCK waits that gave up */
+} rx_ring_stats;
+
+extern int rx_xfer_count;
+extern int rx_backpressure;
+extern int rx_block_timeout_ms;
+extern int rx_event_thread;  /* service libusb on its own thread (default 1) */
+extern int rx_workers;       /* threads running the callback (default 1) */
+
+/* poll_btle() scheduling: wait between polls in microseconds, and
+ * whether to print polls vs. packets every second */
+extern int poll_min_interval_us;
+extern int poll_max_interval_us;
+extern int poll_stats;
+
+/* BR/EDR: keep received symbols packed one per bit rather than one per
+ * char (default 0) */
+extern int packed_symbols;
+
 typedef struct {
 	unsigned allowed_access_address_errors;
+	lell_tracker *tracker; /* connections seen, if not NULL */
 } btle_options;
 
 struct libusb_device_handle* ubertooth_start(int ubertooth_device);
@@ -54,13 +96,18 @@ int specan(struct libusb_device_handle* devh, int xfer_size, u16 num_blocks,
 int do_specan(struct libusb_device_handle* devh, int xfer_size, u16 num_blocks,
 	u16 low_freq, u16 high_freq, char gnuplot);
 int cmd_ping(struct libusb_device_handle* devh);
+void stop_transfers(int sig);
 int stream_rx_usb(struct libusb_device_handle* devh, int xfer_size,
 	uint16_t num_blocks, rx_callback cb, void* cb_args);
+void get_rx_ring_stats(rx_ring_stats *stats);
+void print_rx_ring_stats(FILE *fp);
 int stream_rx_file(FILE* fp, uint16_t num_blocks, rx_callback cb, void* cb_args);
 void rx_live(struct libusb_device_handle* devh, btbb_piconet* pn, int timeout);
 void rx_file(FILE* fp, btbb_piconet* pn);
+int rx_search_benchmark(FILE* fp);
 void rx_dump(struct libusb_device_handle* devh, int full);
-void rx_btle(struct libusb_device_handle* devh);
+int rx_btle(struct libusb_device_handle* devh, btle_options* opts);
+int poll_btle(struct libusb_device_handle* devh, btle_options* opts);
 void rx_btle_file(FILE* fp);
 void cb_btle(void* args, usb_pkt_rx *rx, int bank);
 
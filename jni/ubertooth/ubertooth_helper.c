@@ -46,6 +46,9 @@ static jmethodID gJMethodIDBtle;
 static jobject gJavaObject;
 static volatile bool rx_LAP_running = false;
 static volatile bool rx_BTLE_running = false;
+/* BLE connections seen by StartRxBTLE() */
+static lell_tracker *btle_tracker = NULL;
+#define BTLE_TRACKED_CONNECTIONS 64
 
 //LAP-variables
 static uint32_t start_clk100ns = 0;
@@ -55,10 +58,6 @@ static uint64_t abs_start_ns;
 
 static usb_pkt_rx packets[NUM_BANKS];
 static char symbols[NUM_BANKS][BANK_LEN];
-static u8 *empty_buf = NULL;
-static u8 *full_buf = NULL;
-static volatile u8 really_full = 0;
-static struct libusb_transfer *rx_xfer = NULL;
 static int max_ac_errors = 1;
 static uint32_t systime;
 
@@ -144,42 +143,6 @@ jint JNI_OnLoad(JavaVM* aVm, void* aReserved) {
 	return JNI_VERSION_1_6;
 }
 
-static void cb_xfer(struct libusb_transfer *xfer) {
-	int r;
-	uint8_t *tmp;
-
-	if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
-		__android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "rx_xfer status: %d\n",
-				xfer->status);
-		libusb_free_transfer(xfer);
-		rx_xfer = NULL;
-		return;
-	}
-
-	while (really_full) {
-		__android_log_print(ANDROID_LOG_ERROR, LOG_TAG,
-				"uh oh, full_buf not emptied\n");
-	}
-	//__android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "buffer is full !\n");
-
-	tmp = full_buf;
-	full_buf = empty_buf;
-	empty_buf = tmp;
-	really_full = 1;
-
-	rx_xfer->buffer = empty_buf;
-
-	while (1) {
-		r = libusb_submit_transfer(rx_xfer);
-		if (r < 0) {
-			__android_log_print(ANDROID_LOG_ERROR, LOG_TAG,
-					"rx_xfer submission from callback: %d\n", r);
-		} else {
-			break;
-		}
-	}
-}
-
 static void unpack_symbols(uint8_t* buf, char* unpacked) {
 	int i, j;
 
@@ -426,7 +389,8 @@ void cb_btle_packet(JNIEnv* env, jobject thiz, void* args, usb_pkt_rx *rx,
 		int bank) {
 	FILE *infile = NULL;
 	FILE *dumpfile = NULL;
-	lell_packet * pkt;
+	/* decoded into the same packet every time */
+	static lell_packet * pkt = NULL;
 	btle_options * opts = (btle_options *) args;
 	int i;
 	u32 access_address = 0;
@@ -457,15 +421,15 @@ void cb_btle_packet(JNIEnv* env, jobject thiz, void* args, usb_pkt_rx *rx,
 		}
 	}
 
-	lell_allocate_and_decode(rx->data, rx->channel + 2402, rx->clk100ns, &pkt);
-
 	/* do nothing further if filtered due to bad AA */
 	if (opts
 			&& (opts->allowed_access_address_errors
-					< lell_get_access_address_offenses(pkt))) {
-		lell_packet_unref(pkt);
+					< lell_stream_aa_offenses(rx->data, rx->channel + 2402)))
 		return;
-	}
+
+	if (pkt == NULL)
+		pkt = lell_packet_new();
+	lell_decode_into(rx->data, rx->channel + 2402, rx->clk100ns, pkt);
 
 	/* Dump to PCAP/PCAPNG if specified */
 	refAA = lell_packet_is_data(pkt) ? 0 : 0x8e89bed6;
@@ -606,89 +570,36 @@ void cb_btle_packet(JNIEnv* env, jobject thiz, void* args, usb_pkt_rx *rx,
 //	return 0;
 //}
 
+/* JNI context handed to cb_lap() through stream_rx_usb() */
+typedef struct {
+	JNIEnv* env;
+	jobject thiz;
+} jni_rx_args;
+
+static void cb_rx_lap(void* args, usb_pkt_rx *rx, int bank) {
+	jni_rx_args *jargs = (jni_rx_args *) args;
+
+	cb_lap(jargs->env, jargs->thiz, NULL, rx, bank);
+}
+
 jint Java_com_gnychis_ubertooth_DeviceHandlers_UbertoothOne_StartRxLAP(
 		JNIEnv* env, jobject thiz) {
 	int r;
-	int i;
-	int xfer_blocks;
-	int num_xfers;
-	uint8_t bank = 0;
-	uint8_t rx_buf1[BUFFER_SIZE];
-	uint8_t rx_buf2[BUFFER_SIZE];
-	int xfer_size = PKT_LEN * 2; // XFER_LEN
-	uint16_t num_blocks = 0;
+	jni_rx_args args = { env, thiz };
 
 	__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "call to start_rxLAP()");
 	rx_LAP_running = true;
 
-	/* INIT from stream_rx_usb */
-	/*
-	 * A block is 64 bytes transferred over USB (includes 50 bytes of rx symbol
-	 * payload).  A transfer consists of one or more blocks.  Consecutive
-	 * blocks should be approximately 400 microseconds apart (timestamps about
-	 * 4000 apart in units of 100 nanoseconds).
-	 */
-
-	if (xfer_size > BUFFER_SIZE)
-		xfer_size = BUFFER_SIZE;
-	xfer_blocks = xfer_size / PKT_LEN;
-	xfer_size = xfer_blocks * PKT_LEN;
-	num_xfers = num_blocks / xfer_blocks;
-	num_blocks = num_xfers * xfer_blocks;
-
-	__android_log_print(ANDROID_LOG_INFO, LOG_TAG,
-			"rx %d blocks of 64 bytes in %d byte transfers\n", num_blocks,
-			xfer_size);
-
-	empty_buf = &rx_buf1[0];
-	full_buf = &rx_buf2[0];
-	really_full = 0;
-	rx_xfer = libusb_alloc_transfer(0);
-	libusb_fill_bulk_transfer(rx_xfer, devh, DATA_IN, empty_buf, xfer_size,
-			cb_xfer, NULL, TIMEOUT);
-
-	cmd_rx_syms(devh, num_blocks);
-
-	r = libusb_submit_transfer(rx_xfer);
+	/* Blocks are handed over from the libusb callback through the
+	 * receive ring in ubertooth.c; StopRxLAP() ends the stream. */
+	cmd_rx_syms(devh, 0);
+	r = stream_rx_usb(devh, PKT_LEN * 2, 0, cb_rx_lap, &args);
+	rx_LAP_running = false;
 	if (r < 0) {
 		__android_log_print(ANDROID_LOG_INFO, LOG_TAG,
-				"rx_xfer submission: %d\n", r);
+				"stream_rx_usb: %d\n", r);
 		return -1;
 	}
-
-	/* end of INIT from stream_rx_usb */
-
-	while (rx_LAP_running == true) {
-
-		// here's the magic.
-		while (!really_full && (rx_LAP_running == true)) { // really_full filled in cb_xfer()
-			/*
-			 will block here !
-			 struct timeval tv;
-			 tv.tv_sec = 2;
-			 tv.tv_usec = 0;
-			 return libusb_handle_events_timeout(ctx, &tv);
-			 */
-			r = libusb_handle_events(NULL);	// timeout : 2 seconds
-			if (r < 0) {
-				__android_log_print(ANDROID_LOG_INFO, LOG_TAG,
-						"libusb_handle_events: %d\n", r);
-				return -1;
-			}
-		}
-//		__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "transfer completed: blocks %d, bank %d\n", xfer_blocks, bank);
-
-		/* process each received block */
-		for (i = 0; i < xfer_blocks; i++) {
-
-			cb_lap(env, thiz, NULL, (usb_pkt_rx *) (full_buf + PKT_LEN * i),
-					bank);
-
-			bank = (bank + 1) % NUM_BANKS;
-		}
-		really_full = 0;
-	}
-	libusb_free_transfer(rx_xfer);
 	__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "start_rxLAP() done");
 	return 0;
 }
@@ -740,6 +651,8 @@ jint Java_com_gnychis_ubertooth_DeviceHandlers_UbertoothOne_LAPResult(
 jint Java_com_gnychis_ubertooth_DeviceHandlers_UbertoothOne_StopRxLAP(
 		JNIEnv* env, jobject thiz) {
 	__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "call to stop_rxLAP()");
+	if (rx_LAP_running)
+		stop_transfers(0);
 	rx_LAP_running = false;
 	__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "stop_rxLAP() done");
 	return 0;
@@ -748,6 +661,8 @@ jint Java_com_gnychis_ubertooth_DeviceHandlers_UbertoothOne_StopRxLAP(
 jint Java_com_gnychis_ubertooth_DeviceHandlers_UbertoothOne_StopRxBTLE(
 		JNIEnv* env, jobject thiz) {
 	__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "call to stop_rxBTLE()");
+	if (rx_BTLE_running == true)
+		stop_transfers(0);
 	rx_BTLE_running = false;
 	__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "stop_rxBTLE() done");
 	return 0;
@@ -825,9 +740,11 @@ jint Java_com_gnychis_ubertooth_DeviceHandlers_UbertoothOne_StartRxBTLE(
 // END File creation tests
 
 	rx_BTLE_running = true;
-	usb_pkt_rx pkt;
 	int do_adv_index = 37;
-	btle_options cb_opts = { .allowed_access_address_errors = 32 };
+	if (!btle_tracker)
+		btle_tracker = lell_tracker_new(BTLE_TRACKED_CONNECTIONS);
+	btle_options cb_opts = { .allowed_access_address_errors = 32,
+				 .tracker = btle_tracker };
 
 	if (!h_pcap_le) {
 		//if (lell_pcap_ppi_create_file("/sdcard/capturing2141.pcap", 0, &h_pcap_le)) {
@@ -859,19 +776,11 @@ jint Java_com_gnychis_ubertooth_DeviceHandlers_UbertoothOne_StartRxBTLE(
 	cmd_set_channel(devh, channel);
 	cmd_btle_sniffing(devh, 2);
 
-	//poll data
-	while (rx_BTLE_running == true) {
-		int r = cmd_poll(devh, &pkt);
-		if (r < 0) {
-			//printf("USB error\n");
-			__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "USB error\n");
-			break;
-		}
-		if (r == sizeof(usb_pkt_rx))
-			__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "Packet received");
-		cb_btle(&cb_opts, &pkt, 0);
-		usleep(500);
-	}
+	/* stream from the bulk endpoint (polling if the firmware can't)
+	 * until StopRxBTLE() */
+	if (rx_btle(devh, &cb_opts) < 0)
+		__android_log_print(ANDROID_LOG_INFO, LOG_TAG, "USB error\n");
+	rx_BTLE_running = false;
 	ubertooth_stop(devh);
 }
 
@@ -964,6 +873,30 @@ jintArray Java_com_gnychis_ubertooth_DeviceHandlers_UbertoothOne_scanSpectrum(
 	return result;
 }
 
+// Returns the access addresses of BLE connections heard within maxAgeMs;
+// maxAgeMs <= 0, or one too large for the tracker's 100 ns ages, returns all
+jintArray Java_com_gnychis_ubertooth_DeviceHandlers_UbertoothOne_LiveBTLEConnections(
+		JNIEnv* env, jobject thiz, jint maxAgeMs) {
+	lell_connection conns[BTLE_TRACKED_CONNECTIONS];
+	jint aa[BTLE_TRACKED_CONNECTIONS];
+	jintArray result;
+	uint32_t max_age = UINT32_MAX;
+	int i, n = 0;
+
+	if (maxAgeMs > 0 && (uint32_t) maxAgeMs <= UINT32_MAX / 10000)
+		max_age = (uint32_t) maxAgeMs * 10000;
+	if (btle_tracker)
+		n = lell_tracker_live(btle_tracker, max_age,
+				conns, BTLE_TRACKED_CONNECTIONS);
+	for (i = 0; i < n; i++)
+		aa[i] = (jint) conns[i].access_address;
+
+	result = (*env)->NewIntArray(env, n);
+	if (result != NULL && n > 0)
+		(*env)->SetIntArrayRegion(env, result, 0, n, aa);
+	return result;
+}
+
 jint Java_com_gnychis_ubertooth_DeviceHandlers_UbertoothOne_SaveGlobalObject(
 		JNIEnv* env, jobject thiz, jobject obj) {
 	__android_log_print(ANDROID_LOG_INFO, LOG_TAG,
@@ -363,4 +363,8 @@ public class UbertoothOne {
 	public native int StopRxBTLE();
 
 	public native int[] scanSpectrum(int low_freq, int high_freq, int sweeps);
+
+	// Access addresses of BLE connections heard in the last maxAgeMs;
+	// maxAgeMs <= 0 returns every tracked connection
+	public native int[] LiveBTLEConnections(int maxAgeMs);
 }